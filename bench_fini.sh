@@ -0,0 +1,57 @@
+#!/bin/bash
+# Teardown time of the tool for flop_loop with 1, 2, 4, ... N threads and -per_call 1,
+# where every call of flop_kernel keeps its own counters. The counts of a thread are
+# merged into the totals at its ThreadFini, so the teardown is the ThreadFini time
+# summed over all threads ("* ThreadFini took") plus the Fini time ("* Fini took").
+# The live counters grow with threads x calls; the teardown time per live counter
+# should stay roughly constant. Fails if it grows by more than MAX_GROWTH from 1 to
+# N threads, or if flop_kernel was not counted.
+#
+# Usage: ./bench_fini.sh <pin> <tool> <flop_loop.exe> [max threads] [calls per thread]
+
+PIN=${1}
+TOOL=${2}
+APP=${3}
+NCPU=$(nproc)
+MAXTHREADS=${4:-$(( NCPU < 16 ? NCPU : 16 ))}
+CALLS=${5:-20000}
+MAX_GROWTH=${MAX_GROWTH:-4}
+REPORT=$(mktemp)
+trap "rm -f ${REPORT}" EXIT
+
+printf "%-10s %14s %16s %12s %16s\n" "[threads]" "[counters]" "[threadfini ms]" "[fini ms]" "[ns/counter]"
+base=""
+nthreads=1
+while [ ${nthreads} -le ${MAXTHREADS} ]; do
+    # -format csv sends the "* ThreadFini took" and "* Fini took" messages to stderr
+    read tfms fms <<< $(${PIN} -t ${TOOL} -rtn flop_kernel -per_call 1 -format csv -o ${REPORT} -- ${APP} ${CALLS} ${nthreads} \
+                        2>&1 > /dev/null | awk '/^\* ThreadFini took/ { t = $4 } /^\* Fini took/ { f = $4 } END { print t, f }')
+    if [ -z "${fms}" ]; then
+        echo "run with ${nthreads} threads failed"
+        exit 1
+    fi
+    # The calls of the routine total (the record without tid)
+    calls=$(awk -F, 'NR == 1 { for(i=1; i<=NF; i++) col[$i] = i; next }
+                     $1 == "routine" && $col["tid"] == "" && $col["routine"] == "flop_kernel" { print $col["calls"] }' ${REPORT})
+    if [ -z "${calls}" ] || [ "${calls}" -eq 0 ]; then
+        echo "flop_kernel was not counted with ${nthreads} threads"
+        exit 1
+    fi
+    counters=$(( nthreads * CALLS ))
+    per=$(awk "BEGIN { print (${tfms} + ${fms}) * 1000000 / ${counters} }")
+    printf "%-10s %14s %16s %12s %16.1f\n" ${nthreads} ${counters} ${tfms} ${fms} ${per}
+    base=${base:-${per}}
+    last=${per}
+    if [ ${nthreads} -lt ${MAXTHREADS} ] && [ $(( nthreads * 2 )) -gt ${MAXTHREADS} ]; then
+        nthreads=${MAXTHREADS}
+    else
+        nthreads=$(( nthreads * 2 ))
+    fi
+done
+
+# Below 1 ms the ratio is only noise
+awk "BEGIN { exit !(${last} <= ${MAX_GROWTH} * ${base} || ${last} * ${CALLS} * ${MAXTHREADS} < 1000000) }"
+if [ ${?} -ne 0 ]; then
+    echo "Teardown time per counter grew by more than ${MAX_GROWTH}x"
+    exit 1
+fi
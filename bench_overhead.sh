@@ -0,0 +1,128 @@
+#!/bin/bash
+# Overhead of the tool on a fixed set of kernels. Every kernel runs natively and
+# under the tool REPS times (the fastest run is kept), and one CSV line is written:
+#   kernel,native_ms,tool_ms,slowdown,instrument_ms,fini_ms,native_rss_kb,tool_rss_kb
+# instrument_ms and fini_ms are the "* Instrumentation took" and "* Fini took"
+# messages of the tool; the peak RSS comes from GNU time (-1 without it).
+# A kernel whose report has no counted target routine fails the run, since it
+# would only measure Pin itself.
+#
+# The compare mode flags the kernels whose slowdown, instrumentation time, Fini
+# time or peak RSS under the tool grew by more than THRESHOLD percent (default 10)
+# over a baseline results file, and fails if there is one.
+#
+# Usage: ./bench_overhead.sh run <pin> <tool> <objdir> > results.csv
+#        ./bench_overhead.sh compare <baseline.csv> <results.csv> [threshold %]
+
+MODE=${1}
+REPS=${REPS:-3}
+TIME=/usr/bin/time
+
+# Fixed kernels: name|target routines and options|application and arguments
+KERNELS=(
+    "flop_loop|-rtn main|flop_loop.exe 20000000"
+    "flop_loop_threads|-rtn flop_kernel|flop_loop.exe 2000000 4"
+    "flop_loop_per_call|-rtn flop_kernel -per_call 1|flop_loop.exe 20000 4"
+    "matrix_multiplications|-rtn multiplyMatrix -rtn multiplySparseMatrix|matrix_multiplications.exe 4"
+)
+
+# Run a command, print "<wall ms> <peak RSS kB>" and keep its stderr in ${ERR}
+measure() {
+    local t0 t1 rss=-1
+    t0=$(date +%s%N)
+    if [ -x ${TIME} ]; then
+        ${TIME} -f "%M" -o ${RSS} "$@" > /dev/null 2> ${ERR}
+    else
+        "$@" > /dev/null 2> ${ERR}
+    fi
+    t1=$(date +%s%N)
+    [ -x ${TIME} ] && rss=$(tail -1 ${RSS})
+    echo $(( (t1 - t0) / 1000000 )) ${rss}
+}
+
+run() {
+    local PIN=${1} TOOL=${2} OBJDIR=${3}
+    ERR=$(mktemp)
+    RSS=$(mktemp)
+    REPORT=$(mktemp)
+    echo "kernel,native_ms,tool_ms,slowdown,instrument_ms,fini_ms,native_rss_kb,tool_rss_kb"
+    for k in "${KERNELS[@]}"; do
+        IFS='|' read name opts app <<< "${k}"
+        local native="" tool="" nrss tjit tfini trss
+        for (( r=0; r<REPS; r++ )); do
+            read ms rss <<< $(measure ${OBJDIR}${app})
+            if [ -z "${native}" ] || [ ${ms} -lt ${native} ]; then
+                native=${ms}
+                nrss=${rss}
+            fi
+            # -format csv sends the messages of the tool to stderr
+            read ms rss <<< $(measure ${PIN} -t ${TOOL} ${opts} -format csv -o ${REPORT} -- ${OBJDIR}${app})
+            jit=$(awk '/^\* Instrumentation took/ { print $4 }' ${ERR})
+            fini=$(awk '/^\* Fini took/ { print $4 }' ${ERR})
+            if [ -z "${fini}" ]; then
+                echo "${name} failed under the tool" >&2
+                rm -f ${ERR} ${RSS} ${REPORT}
+                exit 1
+            fi
+            # Routine totals (records without tid) with executed instructions
+            counted=$(awk -F, 'NR == 1 { for(i=1; i<=NF; i++) col[$i] = i; next }
+                               $1 == "routine" && $col["tid"] == "" && $col["icount"] > 0 { n++ }
+                               END { print n + 0 }' ${REPORT})
+            if [ ${counted} -eq 0 ]; then
+                echo "${name}: no target routine was counted (${opts})" >&2
+                rm -f ${ERR} ${RSS} ${REPORT}
+                exit 1
+            fi
+            if [ -z "${tool}" ] || [ ${ms} -lt ${tool} ]; then
+                tool=${ms}
+                tjit=${jit}
+                tfini=${fini}
+                trss=${rss}
+            fi
+        done
+        slowdown=$(awk "BEGIN { printf \"%.2f\", ${tool} / (${native} > 0 ? ${native} : 1) }")
+        echo "${name},${native},${tool},${slowdown},${tjit},${tfini},${nrss},${trss}"
+    done
+    rm -f ${ERR} ${RSS} ${REPORT}
+}
+
+# Times below MIN_MS (default 20) are only noise and never flagged
+compare() {
+    local BASE=${1} CUR=${2} THRESHOLD=${3:-10}
+    awk -F, -v threshold=${THRESHOLD} -v min_ms=${MIN_MS:-20} '
+        FNR == 1 { for(i=1; i<=NF; i++) col[$i] = i; next }
+        NR == FNR { for(i=1; i<=NF; i++) base[$1, i] = $i; seen[$1] = 1; next }
+        function check(metric, floor_metric,   b, c) {
+            b = base[$1, col[metric]]
+            c = $col[metric]
+            if( b < 0 || c < 0 || (base[$1, col[floor_metric]] < min_ms && $col[floor_metric] < min_ms) )
+                return
+            if( c > b * (1 + threshold / 100) ) {
+                printf "REGRESSION %s %s: %s -> %s\n", $1, metric, b, c
+                bad++
+            }
+        }
+        {
+            if( !($1 in seen) ) {
+                printf "new kernel %s\n", $1
+                next
+            }
+            check("slowdown", "tool_ms")
+            check("instrument_ms", "instrument_ms")
+            check("fini_ms", "fini_ms")
+            check("tool_rss_kb", "tool_ms")
+        }
+        END {
+            if( bad ) {
+                printf "%d regressions beyond %s%%\n", bad, threshold
+                exit 1
+            }
+            printf "no regression beyond %s%%\n", threshold
+        }' ${BASE} ${CUR}
+}
+
+case ${MODE} in
+    run)     run "${2}" "${3}" "${4}" ;;
+    compare) compare "${2}" "${3}" "${4}" ;;
+    *)       sed -n '/^# Usage/,/^$/p' ${0}; exit 1 ;;
+esac
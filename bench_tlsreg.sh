@@ -0,0 +1,48 @@
+#!/bin/bash
+# Compare the wall time of instrumented runs between the tool built at a base
+# revision and the tool in the working tree, e.g. the revision before the
+# counters moved into scratch registers (PIN_GetThreadData on every executed
+# instruction).
+# The applications run without arguments: tools of older revisions take the
+# last argument of the command line as the application image.
+#
+# Usage: PIN_ROOT=<pin kit> ./bench_tlsreg.sh <base-rev>
+
+if [ -z "${PIN_ROOT}" ]; then
+    echo "PIN_ROOT is not set"
+    exit 1
+fi
+if [ -z "${1}" ]; then
+    sed -n '/^# Usage/p' ${0}
+    exit 1
+fi
+
+BASE=${1}
+OBJDIR=obj-intel64
+BASEDIR=$(mktemp -d)
+
+git worktree add -f --detach ${BASEDIR} ${BASE} > /dev/null || exit 1
+trap "git worktree remove -f ${BASEDIR}" EXIT
+
+make PIN_ROOT=${PIN_ROOT} -C ${BASEDIR} ${OBJDIR}/flop_counter.so > /dev/null &&
+make PIN_ROOT=${PIN_ROOT} ${OBJDIR}/flop_counter.so ${OBJDIR}/flop_loop.exe ${OBJDIR}/matrix_multiplications.exe > /dev/null
+if [ ${?} -ne 0 ]; then
+    echo "make failed"
+    exit 1
+fi
+
+# Wall time in seconds of one run
+run() {
+    local start=$(date +%s.%N)
+    "$@" > /dev/null 2>&1
+    local end=$(date +%s.%N)
+    awk "BEGIN { print ${end} - ${start} }"
+}
+
+printf "%-28s %12s %12s %12s\n" "[Program]" "[native]" "[base]" "[current]"
+for app in "${OBJDIR}/matrix_multiplications.exe" "${OBJDIR}/flop_loop.exe"; do
+    native=$(run ${app})
+    base=$(run ${PIN_ROOT}/pin -t ${BASEDIR}/${OBJDIR}/flop_counter.so -- ${app})
+    current=$(run ${PIN_ROOT}/pin -t ./${OBJDIR}/flop_counter.so -- ${app})
+    printf "%-28s %12.3f %12.3f %12.3f\n" "$(basename ${app})" ${native} ${base} ${current}
+done
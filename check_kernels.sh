@@ -0,0 +1,77 @@
+#!/bin/bash
+# FLOP accuracy and overhead of the tool per ISA class. flop_kernels runs one
+# kernel routine per instruction family (SSE, AVX2, FMA3, AVX-512, AVX-512
+# masked, x87, FP16) and prints its known FLOP count; the tool must count
+# exactly as many FLOP in each routine. The slowdown of every kernel under the
+# tool is printed next to it. Kernels the CPU does not support are skipped.
+# The tool runs once per counting mode (per BBL, per instruction, -flop_only)
+# and every mode must report the same instructions and FLOP per routine.
+# Fails on any mismatch.
+#
+# Usage: ./check_kernels.sh <pin> <tool> <flop_kernels.exe> [iterations]
+
+PIN=${1}
+TOOL=${2}
+APP=${3}
+ITERS=${4:-10000000}
+
+# The first mode is the default one, its report is checked against the known answers
+MODES=("-bbl 1" "-bbl 0" "-bbl 1 -flop_only 1" "-bbl 0 -flop_only 1")
+
+TMP=$(mktemp -d)
+trap "rm -rf ${TMP}" EXIT
+NATIVE=${TMP}/native
+INSTR=${TMP}/instr
+REPORT=${TMP}/report.0
+
+if ! ${APP} ${ITERS} > ${NATIVE}; then
+    echo "${APP} failed"
+    exit 1
+fi
+for m in "${!MODES[@]}"; do
+    if ! ${PIN} -t ${TOOL} ${MODES[$m]} -rtn 'kernel_*' -format csv -o ${TMP}/report.${m} -- ${APP} ${ITERS} \
+        > ${TMP}/instr.${m} 2> /dev/null; then
+        echo "${APP} failed under the tool (${MODES[$m]})"
+        exit 1
+    fi
+done
+cp ${TMP}/instr.0 ${INSTR}
+
+# routine, instructions and FLOP of the routine totals of a report (records without tid)
+totals() {
+    awk -F, 'FNR == 1 { for(i=1; i<=NF; i++) col[$i] = i; next }
+             $1 == "routine" && $col["tid"] == "" { print $col["routine"], $col["icount"], $col["flop"] }' ${1} | sort
+}
+bad=0
+for m in "${!MODES[@]}"; do
+    [ ${m} -eq 0 ] && continue
+    if ! diff <(totals ${REPORT}) <(totals ${TMP}/report.${m}) > ${TMP}/diff; then
+        echo "${MODES[$m]} counts differently from ${MODES[0]} (routine icount flop):"
+        cat ${TMP}/diff
+        bad=1
+    fi
+done
+
+# native output, instrumented output, then the routine totals of the report (records without tid)
+awk -F'[ ,]' '
+    FILENAME == ARGV[1] && $1 ~ /^kernel_/ { native[$1] = $4; next }
+    FILENAME == ARGV[2] && $1 == "skip" { printf "%-22s %-12s skipped, not supported by the CPU\n", $2, $3; next }
+    FILENAME == ARGV[2] && $1 ~ /^kernel_/ { isa[$1] = $2; expected[$1] = $3; ms[$1] = $4; order[n++] = $1; next }
+    FILENAME == ARGV[3] && FNR == 1 { for(i=1; i<=NF; i++) col[$i] = i; next }
+    FILENAME == ARGV[3] && $1 == "routine" && $col["tid"] == "" { counted[$col["routine"]] = $col["flop"] }
+    END {
+        printf "%-22s %-12s %14s %14s %10s %10s %10s\n", "[routine]", "[isa]", "[expected]", "[counted]", "[native ms]", "[tool ms]", "[slowdown]"
+        for(k=0; k<n; k++) {
+            r = order[k]
+            c = (r in counted) ? counted[r] : "-"
+            printf "%-22s %-12s %14s %14s %10.1f %10.1f %10.2f %s\n", r, isa[r], expected[r], c,
+                native[r], ms[r], (native[r] > 0 ? ms[r] / native[r] : 0), (c == expected[r] ? "" : "MISMATCH")
+            if( c != expected[r] )
+                bad++
+        }
+        if( n == 0 || bad ) {
+            printf "%d of %d kernels counted wrong\n", bad, n
+            exit 1
+        }
+    }' ${NATIVE} ${INSTR} ${REPORT} || bad=1
+exit ${bad}
@@ -10,7 +10,15 @@
 #include <vector>
 #include <cstdlib>
 #include <map>
+#include <set>
+#include <unordered_set>
+#include <algorithm>
+#include <regex.h>
+#include <time.h>
 #include "control_manager.H"
+#include "report_writer.H"
+#include "image_cache.H"
+#include "live_counters.H"
 
 using std::setw;
 using std::hex;
@@ -20,89 +28,345 @@ using std::ios;
 using std::endl;
 using std::dec;
 using std::stringstream;
+using namespace CONTROLLER;
 
 // Force each thread's data to be in its own data cache line so that
 // multiple threads do not contend for the same data cache line.
 // This avoids the false sharing problem.
-// 64 byte line size: 64-8-8-8-8 = 32
-#define PADSIZE 32
+// 64 byte line size: 256-8*17-32-8 = 80 (17 words and a string before the padding, _next after it)
+#define PADSIZE 80
+
+// Number of INS_COUNT entries (2 * 40 bytes) kept free around every counter table,
+// so that the tables of different threads never share a cache line.
+#define INS_COUNT_PAD 2
 #define INFOS
 #define DEBUG
 
+// Number of locks guarding the total routine counts, by routine ID
+#define MERGE_SHARDS 64
+
+// Trace versions: the counters are only inserted into the VERSION_ON traces
+#define VERSION_OFF 0
+#define VERSION_ON 1
+
+// No hotspot slot (-hotspots)
+#define SPOT_NONE 0xffffffff
+
 /* ================================================================== */
 // Global variables 
 /* ================================================================== */
 
 std::ostream *out = &cerr;
 
+// Progress messages ("* Starting tid ..."), which only go to the result in -format text
+std::ostream *info = &cerr;
+
+// Writer of -format json|csv|bin, 0 for text
+REPORT_WRITER *Writer = 0;
+
+// Name of the application, for the [INFOS] messages; its image is the main executable
 const char *target_image;
 
+/* Default target routines, used when neither -rtn nor -rtn_file is given */
 const char *target_routines[] = {
     "main",
-    // "multiplyMatrix",
-    // "multiplySparseMatrix",
-    // "print_matrix",
-    // "print_sparse_matrix",
     ""  // EOF
 };
 
-/* Use "xed_iform_enum_t" for index */
-typedef struct InsAttr {
-    xed_decoded_inst_t *_xedd;
-    xed_iclass_enum_t _iclass;
-    xed_category_enum_t _cat;
-    xed_extension_enum_t _ext;
-    UINT64 _opdno;
-    UINT64 _elemno;
-    bool _isFLOP;
-    bool _isFMA;
-    bool _isScalarSimd;
-    bool _isMaskOP;
-} INS_ATTR;
+// Target routines compiled once in main() by RTN_initTargets:
+// exact names are looked up in a hash set, glob and regex patterns are tried in order.
+std::unordered_set<string> RtnNames;
+std::vector<string> RtnGlobs;
+std::vector<regex_t> RtnRegexes;
+
+// Hash of the target routine patterns in order, part of the key of the image caches
+UINT64 TargetHash = FNV_OFFSET;
+
+/* Floating-point precision of an iform */
+typedef enum {
+    PREC_NONE,
+    PREC_HALF,
+    PREC_BFLOAT16,
+    PREC_SINGLE,
+    PREC_DOUBLE,
+    PREC_EXTENDED,
+    PREC_LAST
+} PRECISION;
+
+static const char *PrecName[PREC_LAST] = { "-", "half", "bfloat16", "single", "double", "extended" };
+static const UINT32 PrecBits[PREC_LAST] = { 0, 16, 16, 32, 64, 80 };
+
+/* FLOP classification of every iform, one array per attribute (use "xed_iform_enum_t" for index) */
+typedef struct IformClass {
+    const xed_inst_t *_inst[XED_IFORM_LAST];    // first instruction of the iform in the XED table
+    UINT16 _elemno[XED_IFORM_LAST];             // FP elements per execution, 1 for scalar SIMD
+    UINT8 _isFLOP[XED_IFORM_LAST];
+    UINT8 _fmaWeight[XED_IFORM_LAST];           // FLOP per element: 2 for FMA, else 1
+    UINT8 _prec[XED_IFORM_LAST];                // PRECISION of the elements
+    UINT8 _isScalarSimd[XED_IFORM_LAST];
+    UINT8 _isMaskOP[XED_IFORM_LAST];
+} IFORM_CLASS;
 
 /* Use "xed_iform_enum_t" for index */
 typedef struct InsCount {
     UINT64 _execount;
     UINT64 _cmpcount;
     UINT64 _maskcount;
+    UINT64 _rbytes;         // bytes read from memory
+    UINT64 _wbytes;         // bytes written to memory
 } INS_COUNT;
 
-typedef struct RtnCount {   // sizeof(RtnCount) = 152
+typedef struct RtnCount {   // sizeof(RtnCount) = 208
     RTN _rtn;
+    UINT32 _id;
     string _name;
     string _image;
     UINT64 _address;
+    UINT64 _size;
     UINT64 _rtnCount;
     UINT64 _icount;
     UINT64 _flopcount;
+    UINT64 _rbytes;
+    UINT64 _wbytes;
+    UINT64 _inslen;
     INS_COUNT *_instable;
+    UINT64 _sampled;        // instruction count of the last sample (-sample_*)
+    struct RtnCount * _global;  // counts of the routine ID in total, for the counts of a thread
     struct RtnCount * _next;
 } RTN_COUNT;
 
-class thread_data_t {       // sizeof(thread_data_t) = 64
+/* One sample of a routine in a thread, as written to the -sample_o file. */
+/* The counts are cumulative since the thread started. */
+typedef struct Sample {     // sizeof(Sample) = 32
+    UINT64 _time;           // ns since the tool started
+    UINT32 _tid;
+    UINT32 _rtn;            // routine ID, see the -sample_o file with suffix .rtn
+    UINT64 _icount;
+    UINT64 _flopcount;
+} SAMPLE;
+
+/* Static counts of an iform in a run of instructions: executions and memory bytes */
+typedef struct HistEntry {
+    UINT32 _count;
+    UINT32 _rbytes;
+    UINT32 _wbytes;
+} HIST_ENTRY;
+
+/* Static iform histogram of one counted run of instructions in a BBL */
+typedef struct BblHist {
+    UINT32 _len;
+    UINT32 *_index;
+    HIST_ENTRY *_entry;
+    RtnCount *_owner;       // routine of an image BBL (-img), 0: the current routine of the thread
+    UINT32 _spotLen;
+    UINT32 *_spot;          // hotspot slots of the FLOP instructions of the run (-hotspots)
+} BBL_HIST;
+
+/* A FLOP instruction of a target routine with its own execution counter (-hotspots) */
+typedef struct Spot {
+    ADDRINT _address;
+    RtnCount *_rtn;         // target routine of the instruction
+    xed_iform_enum_t _iform;
+    INT32 _line;
+    const string *_file;    // source file, "" if unknown
+    UINT64 _count;          // executions in the exited threads
+} SPOT;
+
+/* A loop of a target routine, from the back-edges of its static code (-loops). */
+/* Its body is the address range from the header to the last back-edge. */
+typedef struct Loop {
+    ADDRINT _header;        // target of the back-edges, executed once per iteration
+    ADDRINT _end;           // address of the last back-edge
+    RtnCount *_rtn;
+    UINT32 _slot;           // hotspot slot of the header, SPOT_NONE until it is instrumented
+    UINT32 _depth;          // number of loops of the routine containing this one
+    INT32 _line;
+    const string *_file;
+    UINT64 _iterations;
+    UINT64 _flopcount;      // FLOP of the body, inner loops included
+    std::map<xed_iform_enum_t, UINT64> _iformFlop;
+} LOOP;
+
+/* Counts of an image counted as a whole (-img) */
+typedef struct ImgCount {
+    string _name;
+    ADDRINT _low;
+    ADDRINT _high;
+    UINT64 _icount;
+    UINT64 _flopcount;
+    UINT64 _rbytes;
+    UINT64 _wbytes;
+    RtnCount *_rtnList;                     // routines of the image outside the target routines
+    std::map<ADDRINT, RtnCount *> _rtnMap;  // the same by address, 0 for code without symbol
+    struct ImgCount *_next;
+} IMG_COUNT;
+
+/* Routine counts of an exited thread kept for the report (-thread_top, -thread_name) */
+typedef struct ThreadCount {
+    UINT64 _tid;
+    string _name;           // OS name of the thread when it exited, else when it started
+    bool _named;            // kept because its name matches -thread_name
+    UINT64 _icount;
+    UINT64 _flopcount;
+    UINT64 _rtnLen;
+    RtnCount *_rtnList;
+    struct ThreadCount *_next;
+} THREAD_COUNT;
+
+class thread_data_t {       // sizeof(thread_data_t) = 256
   public:
-    thread_data_t() : RtnList_len(0), RtnList(0) {}
+    thread_data_t() : RtnList_len(0), RtnList(0), BblCount(0), RtnSlot_len(0), RtnSlot(0), RtnCur(0), RtnCalls(0), Counting(0),
+        SampleLeft(0), Samples(0), SampleLen(0), Live(0), BblTouched(0), BblTouchedLen(0), RtnPending(0), OsTid(0) {}
     UINT64 tid;             // sizeof(UINT64) = 8
     UINT64 RtnList_len;     // sizeof(UINT64) = 8
     RtnCount *RtnList;      // sizeof(RtnCount *) = 8
-    UINT8 _pad[PADSIZE];    // sizeof(UINT8*PADSIZE) = 32
+    UINT64 *BblCount;       // sizeof(UINT64 *) = 8
+    UINT64 RtnSlot_len;     // sizeof(UINT64) = 8
+    RtnCount **RtnSlot;     // sizeof(RtnCount **) = 8
+    RtnCount *RtnCur;       // sizeof(RtnCount *) = 8
+    UINT64 *RtnCalls;       // sizeof(UINT64 *) = 8
+    volatile UINT64 Counting;   // sizeof(UINT64) = 8
+    volatile INT64 SampleLeft;  // sizeof(INT64) = 8
+    SAMPLE *Samples;        // sizeof(SAMPLE *) = 8
+    UINT64 SampleLen;       // sizeof(UINT64) = 8
+    LIVE_SLOT *Live;        // sizeof(LIVE_SLOT *) = 8
+    UINT32 *BblTouched;     // sizeof(UINT32 *) = 8, IDs of the BBL counters that are not 0
+    UINT64 BblTouchedLen;   // sizeof(UINT64) = 8
+    RtnCount *RtnPending;   // sizeof(RtnCount *) = 8, routine entered while not counting
+    UINT64 OsTid;           // sizeof(UINT64) = 8, OS thread ID, for its name
+    string Name;            // sizeof(string) = 32, OS name of the thread when it started
+    UINT8 _pad[PADSIZE];    // sizeof(UINT8*PADSIZE) = 80
     thread_data_t *_next;   // sizeof(thread_data_t *) = 8
 };
 
-// Glogal attribute table of all instructions
-INS_ATTR insAttr[XED_IFORM_LAST];
+// FLOP classification of all iforms, built once in main() by IFORM_initClass and read-only
+// afterwards, so the instrumentation of concurrently loaded images only looks it up
+IFORM_CLASS IfmClass;
+
+// Dense index of the iforms seen in the target routines, which indexes the INS_COUNT tables.
+// Index 0 stays reserved for XED_IFORM_INVALID, so 0 also means "not seen yet".
+// With -flop_only, index 0 also counts all non-FLOP instructions together.
+UINT32 IformIndex[XED_IFORM_LAST];
+
+// Iform of each dense index
+xed_iform_enum_t IformOf[XED_IFORM_LAST];
+
+// Number of dense indices handed out so far, grows when an image is loaded
+volatile UINT32 IformNum = 1;
+
+// Dense indices ordered by iform, for the report
+std::vector<UINT32> IformSorted;
 
 // Linked list of instruction counts for each routine
 RTN_COUNT *RtnList = 0;
 
-// Linked list of instruction counts for each thread
+// Number of routine IDs handed out so far, the ID indexes thread_data_t::RtnSlot
+UINT32 RtnNum = 0;
+
+// Linked list of the Thread Data of the live threads
 thread_data_t *TdList = 0;
 
+// Thread Data of exited threads, reused with their tables by the next threads,
+// so that the tool memory is bounded by the peak number of live threads
+thread_data_t *TdPool = 0;
+
+// Routine counts of the exited threads kept for the report, and how many of them
+// were kept as -thread_top threads rather than by -thread_name
+THREAD_COUNT *ThdList = 0;
+UINT32 ThdTop = 0;
+
+// Target routines ordered by address, used to find the owner of a trace instruction
+std::map<ADDRINT, RTN_COUNT *> RtnMap;
+
+// Static histograms of the counted BBLs, indexed by BBL ID
+BBL_HIST **BblTable = 0;
+
+// Number of BBL IDs handed out so far
+volatile UINT32 BblNum = 0;
+
+// Images counted as a whole (-img), and the loaded ones by low address
+bool ImgMode = false;
+IMG_COUNT *ImgList = 0;
+std::map<ADDRINT, IMG_COUNT *> ImgMap;
+
+// Static histograms of the BBLs of the counted images, indexed by image BBL ID.
+// Their counters follow the -bbl_max counters of thread_data_t::BblCount, so that
+// the flush at every routine entry does not scan them.
+BBL_HIST **ImgBblTable = 0;
+volatile UINT32 ImgBblNum = 0;
+
+// Number of image BBLs not counted because the image BBL IDs ran out
+UINT32 ImgBblLost = 0;
+
+// Hotspot slots of the static FLOP instructions and loop headers of the target routines
+// (-hotspots, -loops), assigned at instrumentation time. Their counters follow the BBL and
+// image BBL counters of thread_data_t::BblCount, from SpotBase on.
+bool SpotMode = false;
+SPOT *SpotTable = 0;
+volatile UINT32 SpotNum = 0;
+UINT32 SpotBase = 0;
+std::map<ADDRINT, UINT32> SpotMap;
+std::set<string> SpotFiles;
+PIN_LOCK spotLock;
+
+// Number of FLOP instructions without a slot because the slots ran out
+UINT32 SpotLost = 0;
+
+// Loops of the target routines (-loops), and the loaded ones by header address
+std::vector<LOOP> LoopList;
+std::map<ADDRINT, UINT32> LoopHeaders;
+
+// Time spent in the Image and Trace instrumentation of the tool, reported at Fini.
+// Pin runs them under its client lock. The code generation of Pin itself is not included.
+UINT64 InstrumentNs = 0;
+
+// Time spent by the exiting threads in ThreadFini, summed over all threads and reported at Fini:
+// the merge of their counts into the totals, which Fini no longer does.
+volatile UINT64 ThreadFiniNs = 0;
+
 // Key for accessing TLS storage in the threads. initialized once in main()
 static TLS_KEY tls_key = INVALID_TLS_KEY;
 
+// Scratch registers holding the counters of the current thread, so that the
+// analysis routines neither call PIN_GetThreadData nor walk the thread data.
+// RegInsTable: INS_COUNT table of the current routine (RtnList->_instable)
+// RegBblCount: BBL counters of the thread (BblCount)
+// RegThread:   thread data of the thread
+// RegCounting: 1 while the thread counts, selects the trace version
+REG RegInsTable = REG_INVALID();
+REG RegBblCount = REG_INVALID();
+REG RegThread = REG_INVALID();
+REG RegCounting = REG_INVALID();
+
+// Region of interest: -control start/stop triggers (icount, address, SSC marks, ...)
+CONTROL_MANAGER control;
+
+// Counting state of the last event for all threads, taken by the new threads
+volatile UINT64 CountingAll = 0;
+
+// Sampling (-sample_icount, -sample_ms): the samples of all threads go to SampleOut
+bool SampleMode = false;
+std::ofstream *SampleOut = 0;
+PIN_LOCK sampleLock;
+UINT64 SampleStart = 0;
+PIN_THREAD_UID TimerUid;
+volatile bool TimerExit = false;
+UINT32 TimerMs = 0;
+
+// Live counters (-live): the mapped file, and its free thread slots.
+// The slots are only assigned and released under liveLock, which also serializes slot 0.
+bool LiveMode = false;
+LIVE_HEADER *LiveHdr = 0;
+std::vector<UINT32> LiveFree;
+UINT32 LiveNext = 1;
+PIN_LOCK liveLock;
+
 PIN_LOCK pinLock;
 
+// Threads merging their counts into the same total routine counts (TL_mergeCounts)
+// only serialize on the shard of the routine ID.
+PIN_LOCK mergeLock[MERGE_SHARDS];
+
 UINT32 numThreads = 0;
 
 /* ===================================================================== */
@@ -112,6 +376,81 @@ UINT32 numThreads = 0;
 KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE,  "pintool",
     "o", "", "specify file name for MyPinTool output");
 
+KNOB<string> KnobRoutines(KNOB_MODE_APPEND, "pintool",
+    "rtn", "", "target routine: a name, a glob pattern (*, ?, [...]) or re:<regex>, may be repeated (default: main)");
+
+KNOB<string> KnobRoutineFile(KNOB_MODE_WRITEONCE, "pintool",
+    "rtn_file", "", "file with one target routine (same syntax as -rtn) per line, # starts a comment");
+
+KNOB<string> KnobCacheDir(KNOB_MODE_WRITEONCE, "pintool",
+    "cache_dir", "", "directory of the cached target routines per image build-ID, rebuilt when stale (empty: no cache)");
+
+KNOB<string> KnobFormat(KNOB_MODE_WRITEONCE, "pintool",
+    "format", "text", "format of the analysis result: text, json, csv or bin");
+
+KNOB<BOOL> KnobPerCall(KNOB_MODE_WRITEONCE, "pintool",
+    "per_call", "0", "keep the counts of every call of a target routine instead of one per routine and thread");
+
+KNOB<UINT32> KnobThreadTop(KNOB_MODE_WRITEONCE, "pintool",
+    "thread_top", "16", "report the routine counts of the <n> threads with the most FLOP, the others only in total");
+
+KNOB<string> KnobThreadName(KNOB_MODE_APPEND, "pintool",
+    "thread_name", "", "also report the routine counts of the threads whose name matches this glob pattern, may be repeated");
+
+KNOB<BOOL> KnobBblCount(KNOB_MODE_WRITEONCE, "pintool",
+    "bbl", "1", "count executions per basic block instead of per instruction");
+
+KNOB<UINT32> KnobBblMax(KNOB_MODE_WRITEONCE, "pintool",
+    "bbl_max", "65536", "maximum number of basic blocks counted in -bbl mode");
+
+KNOB<string> KnobImages(KNOB_MODE_APPEND, "pintool",
+    "img", "", "also count all code of the images matching this name or glob pattern (* for all), may be repeated");
+
+KNOB<UINT32> KnobImgBblMax(KNOB_MODE_WRITEONCE, "pintool",
+    "img_bbl_max", "262144", "maximum number of basic blocks counted in the -img images");
+
+KNOB<UINT64> KnobSampleIcount(KNOB_MODE_WRITEONCE, "pintool",
+    "sample_icount", "0", "sample the routine counts of a thread every <n> instructions counted in it (0: off)");
+
+KNOB<UINT32> KnobSampleMs(KNOB_MODE_WRITEONCE, "pintool",
+    "sample_ms", "0", "sample the routine counts of all threads every <n> milliseconds (0: off)");
+
+KNOB<string> KnobSampleFile(KNOB_MODE_WRITEONCE, "pintool",
+    "sample_o", "flop_samples.bin", "binary file of the samples, the routine names go to <file>.rtn");
+
+KNOB<UINT32> KnobSampleBuf(KNOB_MODE_WRITEONCE, "pintool",
+    "sample_buf", "4096", "number of samples buffered per thread before they are written");
+
+KNOB<string> KnobLiveFile(KNOB_MODE_WRITEONCE, "pintool",
+    "live", "", "publish the counts per thread and routine to this mapped file while the application runs (see flop_live)");
+
+KNOB<UINT32> KnobLiveMs(KNOB_MODE_WRITEONCE, "pintool",
+    "live_ms", "1000", "publish the -live counts of every thread every <n> milliseconds");
+
+KNOB<UINT32> KnobLiveThreads(KNOB_MODE_WRITEONCE, "pintool",
+    "live_threads", "256", "number of live threads published in the -live file");
+
+KNOB<UINT32> KnobLiveRtn(KNOB_MODE_WRITEONCE, "pintool",
+    "live_rtn", "1024", "number of target routines published in the -live file");
+
+KNOB<double> KnobPeakGflops(KNOB_MODE_WRITEONCE, "pintool",
+    "peak_gflops", "0", "peak FLOP rate of the machine in GFLOP/s, for the roofline placement (0: none)");
+
+KNOB<double> KnobPeakGBs(KNOB_MODE_WRITEONCE, "pintool",
+    "peak_gbs", "0", "peak memory bandwidth of the machine in GB/s, for the roofline placement (0: none)");
+
+KNOB<UINT32> KnobHotspots(KNOB_MODE_WRITEONCE, "pintool",
+    "hotspots", "0", "report the <n> FLOP instructions with the most FLOP per target routine, with their source line (0: off)");
+
+KNOB<UINT32> KnobHotspotMax(KNOB_MODE_WRITEONCE, "pintool",
+    "hotspot_max", "65536", "maximum number of static FLOP instructions counted for -hotspots");
+
+KNOB<BOOL> KnobLoops(KNOB_MODE_WRITEONCE, "pintool",
+    "loops", "0", "find the loops of the target routines by their back-edges and report their iterations and FLOP");
+
+KNOB<BOOL> KnobFlopOnly(KNOB_MODE_WRITEONCE, "pintool",
+    "flop_only", "0", "count only the FLOP instructions per iform, the others only in total");
+
 /* ===================================================================== */
 // Utilities
 /* ===================================================================== */
@@ -144,25 +483,205 @@ const char *StripName(const char * fullname) {
         return fullname;
 }
 
+/* Match one character against the glob element at pat: '?', '[...]' or a literal character. */
+/* Returns the length of the element, or 0 if the character does not match. */
+int GLOB_matchChar(const char *pat, char c) {
+    if(*pat == '?')
+        return 1;
+    if(*pat != '[')
+        return (*pat == c) ? 1 : 0;
+
+    const char *p = pat + 1;
+    bool negate = (*p == '!' || *p == '^');
+    if(negate)
+        p++;
+    const char *first = p;
+    bool found = false;
+    /* A ']' right after the '[' is a literal */
+    while(*p && (*p != ']' || p == first)) {
+        if(p[1] == '-' && p[2] && p[2] != ']') {
+            if(p[0] <= c && c <= p[2])
+                found = true;
+            p += 3;
+        }
+        else {
+            if(*p == c)
+                found = true;
+            p++;
+        }
+    }
+    /* An unterminated '[' is a literal */
+    if(*p != ']')
+        return (c == '[') ? 1 : 0;
+    return (found != negate) ? (int)(p + 1 - pat) : 0;
+}
+
+/* Match a whole name against a glob pattern. */
+bool GLOB_match(const char *pat, const char *str) {
+    const char *star = 0, *retry = 0;
+    int len;
+    while(*str) {
+        if(*pat == '*') {
+            star = ++pat;
+            retry = str;
+        }
+        else if(*pat && (len = GLOB_matchChar(pat, *str)) > 0) {
+            pat += len;
+            str++;
+        }
+        else if(star) {
+            /* Let the last '*' take one more character */
+            pat = star;
+            str = ++retry;
+        }
+        else
+            return false;
+    }
+    while(*pat == '*')
+        pat++;
+    return *pat == 0;
+}
+
+/* Add a target routine name or pattern. Returns false for an invalid regex. */
+bool RTN_addTargetPattern(const string &pat) {
+    TargetHash = FNV_hash(pat.c_str(), pat.size() + 1, TargetHash);
+    if(pat.compare(0, 3, "re:") == 0) {
+        regex_t re;
+        int err = regcomp(&re, pat.c_str() + 3, REG_EXTENDED | REG_NOSUB);
+        if(err != 0) {
+            char buf[256];
+            regerror(err, &re, buf, sizeof(buf));
+            cerr << "Invalid target routine pattern " << pat << ": " << buf << endl;
+            return false;
+        }
+        RtnRegexes.push_back(re);
+    }
+    else if(pat.find_first_of("*?[") != string::npos)
+        RtnGlobs.push_back(pat);
+    else
+        RtnNames.insert(pat);
+    return true;
+}
+
+/* Compile the target routines of -rtn and -rtn_file, or the default target_routines without them. */
+bool RTN_initTargets() {
+    for(UINT32 i=0; i<KnobRoutines.NumberOfValues(); i++) {
+        string pat = KnobRoutines.Value(i);
+        if(!pat.empty() && !RTN_addTargetPattern(pat))
+            return false;
+    }
+
+    if(!KnobRoutineFile.Value().empty()) {
+        std::ifstream in(KnobRoutineFile.Value().c_str());
+        if(!in) {
+            cerr << "Cannot open the target routine file " << KnobRoutineFile.Value() << endl;
+            return false;
+        }
+        string line;
+        while(std::getline(in, line)) {
+            size_t begin = line.find_first_not_of(" \t\r");
+            if(begin == string::npos || line[begin] == '#')
+                continue;
+            size_t end = line.find_last_not_of(" \t\r");
+            if(!RTN_addTargetPattern(line.substr(begin, end - begin + 1)))
+                return false;
+        }
+    }
+
+    if(RtnNames.empty() && RtnGlobs.empty() && RtnRegexes.empty())
+        for(int i=0; *(target_routines[i]); i++)
+            RTN_addTargetPattern(target_routines[i]);
+    return true;
+}
+
+void RTN_freeTargets() {
+    for(UINT32 i=0; i<RtnRegexes.size(); i++)
+        regfree(&RtnRegexes[i]);
+    RtnRegexes.clear();
+}
+
 bool RTN_isTargetRoutine(RTN rtn) {
-    string funcname = PIN_UndecorateSymbolName(RTN_Name(rtn), UNDECORATION_NAME_ONLY);
-    for (int i=0; *(target_routines[i]); i++)
-        if (strcmp(StripName(funcname.c_str()), target_routines[i]) == 0 ) return true;
+    string funcname = RTN_Name(rtn);
+    /* Only C++ symbols need to be undecorated */
+    if(funcname.compare(0, 2, "_Z") == 0) {
+        funcname = PIN_UndecorateSymbolName(funcname, UNDECORATION_NAME_ONLY);
+        funcname = funcname.substr(0, funcname.find('('));
+    }
+    if(RtnNames.count(funcname))
+        return true;
+    for(UINT32 i=0; i<RtnGlobs.size(); i++)
+        if(GLOB_match(RtnGlobs[i].c_str(), funcname.c_str()))
+            return true;
+    for(UINT32 i=0; i<RtnRegexes.size(); i++)
+        if(regexec(&RtnRegexes[i], funcname.c_str(), 0, 0, 0) == 0)
+            return true;
     return false;
 }
 
-bool XEDD_isFLOP(xed_decoded_inst_t* xedd) {
-    xed_operand_element_type_enum_t elem_type = xed_decoded_inst_operand_element_type(xedd, 0);
-    switch (elem_type) {
-        case XED_OPERAND_ELEMENT_TYPE_SINGLE:
-        case XED_OPERAND_ELEMENT_TYPE_DOUBLE:
-        case XED_OPERAND_ELEMENT_TYPE_LONGDOUBLE:
-        case XED_OPERAND_ELEMENT_TYPE_FLOAT16:
-            break;
-        default:
-            return false;
+/* Is the image selected with -img? */
+bool IMG_isCountedImage(IMG img) {
+    const char *name = StripPath(IMG_Name(img).c_str());
+    for(UINT32 i=0; i<KnobImages.NumberOfValues(); i++)
+        if(!KnobImages.Value(i).empty() && GLOB_match(KnobImages.Value(i).c_str(), name))
+            return true;
+    return false;
+}
+
+/* Find the counted image (-img) of an address, 0 if there is none. */
+IMG_COUNT *IMG_findImage(ADDRINT addr) {
+    std::map<ADDRINT, IMG_COUNT *>::iterator it = ImgMap.upper_bound(addr);
+    if (it == ImgMap.begin())
+        return 0;
+    --it;
+    if (addr > it->second->_high)
+        return 0;
+    return it->second;
+}
+
+/* Find the routine counts of an address in a counted image (-img), allocated on first sight. */
+/* Returns 0 if the address is not in a counted image. */
+RTN_COUNT *IMG_findImageRoutine(ADDRINT addr) {
+    IMG_COUNT *ic = IMG_findImage(addr);
+    if (ic == 0)
+        return 0;
+
+    RTN rtn = RTN_FindByAddress(addr);
+    ADDRINT key = RTN_Valid(rtn) ? RTN_Address(rtn) : 0;
+    RTN_COUNT *&rc = ic->_rtnMap[key];
+    if (rc == 0) {
+        rc = new RTN_COUNT;
+        rc->_id = 0;
+        rc->_name = RTN_Valid(rtn) ? RTN_Name(rtn) : "[no symbol]";
+        rc->_image = ic->_name;
+        rc->_address = key;
+        rc->_size = RTN_Valid(rtn) ? RTN_Size(rtn) : 0;
+        rc->_rtnCount = 0;
+        rc->_icount = 0;
+        rc->_flopcount = 0;
+        rc->_rbytes = 0;
+        rc->_wbytes = 0;
+        rc->_inslen = 0;
+        rc->_instable = 0;
+        rc->_sampled = 0;
+        rc->_global = 0;
+        rc->_next = ic->_rtnList;
+        ic->_rtnList = rc;
     }
-    xed_category_enum_t cat = xed_decoded_inst_get_category(xedd);
+    return rc;
+}
+
+/* Find the target routine which contains the given address. */
+RTN_COUNT *RTN_findTargetRoutine(ADDRINT addr) {
+    std::map<ADDRINT, RTN_COUNT *>::iterator it = RtnMap.upper_bound(addr);
+    if (it == RtnMap.begin())
+        return 0;
+    --it;
+    if (addr < it->first + it->second->_size)
+        return it->second;
+    return 0;
+}
+
+bool CAT_isFLOP(xed_category_enum_t cat) {
     switch (cat) {
         case XED_CATEGORY_AVX:
         case XED_CATEGORY_AVX2:
@@ -184,9 +703,19 @@ bool XEDD_isFLOP(xed_decoded_inst_t* xedd) {
     return true;
 }
 
+/* FP arithmetic iclasses of the AVX512 category, by name: add, subtract, multiply, divide, square root, */
+/* min/max, reciprocals, scale and compare (into a mask register). */
+bool ICLASS_isFpArith(xed_iclass_enum_t iclass) {
+    static const char *prefix[] = { "VADD", "VSUB", "VMUL", "VDIV", "VSQRT", "VMIN", "VMAX",
+                                    "VRCP", "VRSQRT", "VSCALEF", "VCMP", "" };
+    const char *name = xed_iclass_enum_t2str(iclass);
+    for(int i=0; *prefix[i]; i++)
+        if( strncmp(name, prefix[i], strlen(prefix[i])) == 0 )
+            return true;
+    return false;
+}
 
-bool XEDD_isFMA(xed_decoded_inst_t* xedd) {
-    xed_category_enum_t cat = xed_decoded_inst_get_category(xedd);
+bool CAT_isFMA(xed_category_enum_t cat) {
     switch (cat) {
         case XED_CATEGORY_AVX512_4FMAPS:
         case XED_CATEGORY_FMA4:
@@ -199,135 +728,829 @@ bool XEDD_isFMA(xed_decoded_inst_t* xedd) {
     return true;
 }
 
-bool XEDD_isScalarSimd(xed_decoded_inst_t* xedd) {
-    return xed_decoded_inst_get_attribute(xedd, XED_ATTRIBUTE_SIMD_SCALAR);
+/* Precision of an operand element type, PREC_NONE if it is not floating point */
+PRECISION XTYPE_precision(xed_operand_element_xtype_enum_t xtype) {
+    switch (xtype) {
+        case XED_OPERAND_XTYPE_F16:
+        case XED_OPERAND_XTYPE_2F16:
+            return PREC_HALF;
+        case XED_OPERAND_XTYPE_BF16:
+            return PREC_BFLOAT16;
+        case XED_OPERAND_XTYPE_F32:
+            return PREC_SINGLE;
+        case XED_OPERAND_XTYPE_F64:
+            return PREC_DOUBLE;
+        case XED_OPERAND_XTYPE_F80:
+            return PREC_EXTENDED;
+        default:
+            return PREC_NONE;
+    }
 }
 
-bool XEDD_isMaskOP(xed_decoded_inst_t* xedd) {
-    return xed_decoded_inst_get_attribute(xedd, XED_ATTRIBUTE_MASKOP);
+/* Classify an iform from one of its instructions in the XED table. */
+/* An iform is a FLOP if operand 0 is a floating point (not bfloat16) operand and its category is a FLOP one. */
+/* XED puts nearly all EVEX instructions in the AVX512 category, FP moves, permutes, blends and conversions */
+/* included, so there only the FP arithmetic iclasses are FLOP, with an FP operand in any place. */
+/* The elements are counted on the FP operand with the most of them rather than on operand 0, */
+/* so compares into a mask register, conversions and broadcasts count all lanes of the vector. */
+void IFORM_classify(xed_iform_enum_t iform, const xed_inst_t *xedi) {
+    PRECISION dest = (xed_inst_noperands(xedi) > 0) ? XTYPE_precision(xed_operand_xtype(xed_inst_operand(xedi, 0))) : PREC_NONE;
+    UINT32 elemno = 0;
+    PRECISION prec = PREC_NONE;
+    for(UINT32 j=0; j<xed_inst_noperands(xedi); j++) {
+        const xed_operand_t *op = xed_inst_operand(xedi, j);
+        PRECISION p = XTYPE_precision(xed_operand_xtype(op));
+        if( p == PREC_NONE )
+            continue;
+        UINT32 n = xed_operand_width_bits(op, 2) / PrecBits[p];
+        if( prec == PREC_NONE || n > elemno ) {
+            elemno = n;
+            prec = p;
+        }
+    }
+
+    xed_category_enum_t cat = xed_iform_to_category(iform);
+    IfmClass._inst[iform] = xedi;
+    IfmClass._isScalarSimd[iform] = xed_inst_get_attribute(xedi, XED_ATTRIBUTE_SIMD_SCALAR) ? 1 : 0;
+    IfmClass._isMaskOP[iform] = (xed_inst_get_attribute(xedi, XED_ATTRIBUTE_MASKOP)
+        || xed_inst_get_attribute(xedi, XED_ATTRIBUTE_MASKOP_EVEX)) ? 1 : 0;
+    if( cat == XED_CATEGORY_AVX512 )
+        IfmClass._isFLOP[iform] = (prec != PREC_NONE && prec != PREC_BFLOAT16 && ICLASS_isFpArith(xed_iform_to_iclass(iform))) ? 1 : 0;
+    else
+        IfmClass._isFLOP[iform] = (dest != PREC_NONE && dest != PREC_BFLOAT16 && CAT_isFLOP(cat)) ? 1 : 0;
+    IfmClass._fmaWeight[iform] = CAT_isFMA(cat) ? 2 : 1;
+    IfmClass._prec[iform] = prec;
+    IfmClass._elemno[iform] = (IfmClass._isScalarSimd[iform] || elemno == 0) ? 1 : elemno;
+}
+
+/* Classify all iforms once from the static XED instruction table. */
+void IFORM_initClass() {
+    const xed_inst_t *base = xed_inst_table_base();
+    for(UINT32 i=0; i<XED_MAX_INST_TABLE_NODES; i++) {
+        xed_iform_enum_t iform = xed_inst_iform_enum(&base[i]);
+        if( iform <= XED_IFORM_INVALID || iform >= XED_IFORM_LAST || IfmClass._inst[iform] )
+            continue;
+        IFORM_classify(iform, &base[i]);
+    }
 }
 
-void XEDD_printAttribute(xed_decoded_inst_t* xedd) {
-    xed_attributes_t attr = xed_decoded_inst_get_attributes(xedd);
-    for (int i=0; i<64; i++) {
-        if(attr.a1 % 2 == 1) *out << xed_attribute_enum_t2str(static_cast<xed_attribute_enum_t>(i)) << " ";
-        attr.a1/=2;
+/* Find the write mask register {k} of an instruction, XED_REG_INVALID if there is none. */
+/* It is the operand of the MASK1 (MASKNOT0 for gathers and scatters) nonterminal, not the first */
+/* mask register: compares into a mask register and VFPCLASS have their destination k before it. */
+xed_reg_enum_t XEDD_getMaskReg(xed_decoded_inst_t* xedd) {
+    const xed_inst_t* xedi = xed_decoded_inst_inst(xedd);
+    for(UINT32 j=0; j<xed_inst_noperands(xedi); j++) {
+        const xed_operand_t* op = xed_inst_operand(xedi, j);
+        xed_nonterminal_enum_t nt = xed_operand_nonterminal_name(op);
+        if( nt != XED_NONTERMINAL_MASK1 && nt != XED_NONTERMINAL_MASKNOT0 )
+            continue;
+        xed_reg_enum_t reg_enum = xed_decoded_inst_get_reg(xedd, xed_operand_name(op));
+        if( reg_enum >= XED_REG_MASK_FIRST && reg_enum <= XED_REG_MASK_LAST )
+            return reg_enum;
     }
-    for (int i=64; i<XED_ATTRIBUTE_LAST; i++) {
-        if(attr.a2 % 2 == 1) *out << xed_attribute_enum_t2str(static_cast<xed_attribute_enum_t>(i)) << " ";
-        attr.a2/=2;
+    return XED_REG_INVALID;
+}
+
+void XEDI_printAttribute(const xed_inst_t* xedi) {
+    for (int i=XED_ATTRIBUTE_INVALID+1; i<XED_ATTRIBUTE_LAST; i++) {
+        xed_attribute_enum_t attr = static_cast<xed_attribute_enum_t>(i);
+        if(xed_inst_get_attribute(xedi, attr)) *out << xed_attribute_enum_t2str(attr) << " ";
     }
 }
 
+/* Width in bits, element type and, for FP, number of elements of an operand */
+string OPD_str(const xed_operand_t* op) {
+    UINT32 bits = xed_operand_width_bits(op, 2);
+    xed_operand_element_xtype_enum_t xtype = xed_operand_xtype(op);
+    PRECISION p = XTYPE_precision(xtype);
+    string str = decstr(bits) + "/" + xed_operand_element_xtype_enum_t2str(xtype);
+    if( p != PREC_NONE )
+        str += "/" + decstr(bits / PrecBits[p]);
+    return str;
+}
+
 thread_data_t* get_tls(THREADID tid) {
     thread_data_t* tdata = static_cast<thread_data_t*>(PIN_GetThreadData(tls_key, tid));
     return tdata;
 }
 
-/* Count the existing ones in an integer */
-/* Used for the Mask Register of AVX512 */
-int CountOnes(int val) {
-    int num = 0;
-    while(val) {
-        num += val % 2;
-        val /= 2;
+/* Give an iform its dense index when it is first instrumented. */
+UINT32 IFORM_getIndex(xed_iform_enum_t iform) {
+    if( IformIndex[iform] == 0 && iform != XED_IFORM_INVALID ) {
+        IformOf[IformNum] = iform;
+        IformIndex[iform] = IformNum;
+        IformNum = IformNum + 1;
     }
-    return num;
+    return IformIndex[iform];
+}
+
+/* Allocate an INS_COUNT table for the dense iform indices. */
+INS_COUNT *INS_newCountTable(UINT64 len) {
+    INS_COUNT *instable = new INS_COUNT[len + 2 * INS_COUNT_PAD];
+    for(UINT64 i=0; i<len + 2 * INS_COUNT_PAD; i++) {
+        instable[i]._execount = 0;
+        instable[i]._cmpcount = 0;
+        instable[i]._maskcount = 0;
+        instable[i]._rbytes = 0;
+        instable[i]._wbytes = 0;
+    }
+    return instable + INS_COUNT_PAD;
+}
+
+void INS_deleteCountTable(INS_COUNT *instable) {
+    if(instable)
+        delete [] (instable - INS_COUNT_PAD);
+}
+
+/* Allocate the call counters of the routine IDs, padded by a cache line on both sides. */
+UINT64 *RTN_newCallTable(UINT64 len) {
+    UINT64 *calls = new UINT64[len + 16];
+    for(UINT64 i=0; i<len + 16; i++)
+        calls[i] = 0;
+    return calls + 8;
+}
+
+void RTN_deleteCallTable(UINT64 *calls) {
+    if(calls)
+        delete [] (calls - 8);
+}
+
+bool IFORM_lessThan(UINT32 a, UINT32 b) {
+    return IformOf[a] < IformOf[b];
+}
+
+/* Print the arithmetic intensity of FLOP and bytes and, */
+/* with -peak_gflops and -peak_gbs, where it sits in the roofline of the machine. */
+void RC_printRoofline(const char *indent, UINT64 flopcount, UINT64 bytes) {
+    *out << indent << "Arithmetic intensity:";
+    if( bytes == 0 ) {
+        *out << "        n/a (no memory access)" << endl;
+        return;
+    }
+    double intensity = (double)flopcount / bytes;
+    *out << " " << setw(12) << intensity << " FLOP/byte" << endl;
+    if( KnobPeakGflops <= 0 || KnobPeakGBs <= 0 )
+        return;
+
+    double ridge = KnobPeakGflops / KnobPeakGBs;
+    double attainable = std::min((double)KnobPeakGflops, intensity * KnobPeakGBs);
+    *out << indent << "Roofline:             " << (intensity < ridge ? "memory-bound" : "compute-bound")
+         << ", attainable " << attainable << " GFLOP/s (" << 100 * attainable / KnobPeakGflops << "% of peak)"
+         << ", ridge at " << ridge << " FLOP/byte" << endl;
+}
+
+bool RC_moreFlop(RTN_COUNT *a, RTN_COUNT *b) {
+    return a->_flopcount > b->_flopcount;
+}
+
+/* Grow the INS_COUNT table of a routine to the iforms seen so far. */
+/* Only the thread owning the routine counts may call this. */
+void RC_growCountTable(RTN_COUNT *rc) {
+    UINT64 len = IformNum;
+    if(rc->_inslen >= len)
+        return;
+    INS_COUNT *instable = INS_newCountTable(len);
+    for(UINT64 i=0; i<rc->_inslen; i++)
+        instable[i] = rc->_instable[i];
+    INS_deleteCountTable(rc->_instable);
+    rc->_instable = instable;
+    rc->_inslen = len;
+}
+
+/* Deallocate a list of routine counts with their INS_COUNT tables. */
+void RC_deleteList(RTN_COUNT *rl) {
+    for(RTN_COUNT *rc = rl; rc;) {
+        RTN_COUNT *cur = rc;
+        INS_deleteCountTable(rc->_instable);
+        rc = rc->_next;
+        delete cur;
+    }
+}
+
+/* Add the counts of a BBL histogram executed count times to a routine. */
+void HIST_addCounts(RTN_COUNT *rc, BBL_HIST *bh, UINT64 count) {
+    for(UINT32 i=0; i<bh->_len; i++) {
+        INS_COUNT *ic = &rc->_instable[bh->_index[i]];
+        ic->_execount += count * bh->_entry[i]._count;
+        ic->_rbytes += count * bh->_entry[i]._rbytes;
+        ic->_wbytes += count * bh->_entry[i]._wbytes;
+    }
+}
+
+/* Rebuild the Execution Count of the current routine in a Thread Data */
+/* and the hotspot counts from the BBL counters and reset them. */
+/* Only the BBLs run since the last flush are visited (BblTouched), not all BblNum counters. */
+void TL_flushBblCounts(thread_data_t *tdata) {
+    RTN_COUNT *rc = tdata->RtnCur;
+    UINT64 num = tdata->BblTouchedLen;
+    tdata->BblTouchedLen = 0;
+    for(UINT64 t=0; t<num; t++) {
+        UINT32 b = tdata->BblTouched[t];
+        UINT64 count = tdata->BblCount[b];
+        tdata->BblCount[b] = 0;
+        BBL_HIST *bh = BblTable[b];
+        for(UINT32 k=0; k<bh->_spotLen; k++)
+            tdata->BblCount[SpotBase + bh->_spot[k]] += count;
+        if(rc == 0)
+            continue;
+        RC_growCountTable(rc);
+        HIST_addCounts(rc, bh, count);
+    }
+}
+
+/* Add the image BBL counters of a Thread Data to the routines owning the BBLs (-img) and reset them. */
+/* The routine counts are shared by all threads, so the caller holds pinLock. */
+void TL_foldImgBblCounts(thread_data_t *tdata) {
+    UINT32 num = ImgBblNum;
+    UINT64 *bblcount = tdata->BblCount + KnobBblMax;
+    for(UINT32 b=0; b<num; b++) {
+        UINT64 count = bblcount[b];
+        if(count == 0)
+            continue;
+        bblcount[b] = 0;
+        BBL_HIST *bh = ImgBblTable[b];
+        RTN_COUNT *rc = bh->_owner;
+        RC_growCountTable(rc);
+        HIST_addCounts(rc, bh, count);
+    }
+}
+
+/* Calculate the Computation Count of a dense iform index */
+/* based on its Execution Count and Mask Count, 0 for non-FLOP. */
+/* Without mask counts (the -img code), masked FLOP count all of their lanes. */
+UINT64 IFORM_cmpCount(UINT32 i, const INS_COUNT *ic, bool masked) {
+    xed_iform_enum_t iform = IformOf[i];
+    if( !IfmClass._isFLOP[iform] )
+        return 0;
+    UINT64 FMA_weight = IfmClass._fmaWeight[iform];
+    if( IfmClass._isMaskOP[iform] && masked )
+        return ic->_maskcount * FMA_weight;
+    return ic->_execount * FMA_weight * IfmClass._elemno[iform];
 }
 
 /* Calculate the Computation Count and Flop Count */
 /* based on the Execution Count and Mask Count in a Thread Data. */
-void TL_calculateStatistics(RTN_COUNT *trl) {
-    UINT64 FlopCount, FMA_weight, element;
+void TL_calculateStatistics(RTN_COUNT *trl, bool masked) {
+    UINT64 FlopCount;
     for(RTN_COUNT *trc = trl; trc; trc = trc->_next) {
         FlopCount = 0;
-        for(int i=0; i<XED_IFORM_LAST; i++) {
+        for(UINT64 i=0; i<trc->_inslen; i++) {
+            trc->_rbytes += trc->_instable[i]._rbytes;
+            trc->_wbytes += trc->_instable[i]._wbytes;
             if(trc->_instable[i]._execount) {
                 trc->_icount += trc->_instable[i]._execount;
-                if( insAttr[i]._isFLOP) {
-                    FMA_weight = (insAttr[i]._isFMA) ? 2 : 1;
-                    element = insAttr[i]._elemno;
-                    if( insAttr[i]._isMaskOP )
-                        trc->_instable[i]._cmpcount = trc->_instable[i]._maskcount * FMA_weight;
-                    else
-                        trc->_instable[i]._cmpcount = trc->_instable[i]._execount * FMA_weight * element;
-                    FlopCount += trc->_instable[i]._cmpcount;
-                }
+                trc->_instable[i]._cmpcount = IFORM_cmpCount(i, &trc->_instable[i], masked);
+                FlopCount += trc->_instable[i]._cmpcount;
             }
         }
         trc->_flopcount = FlopCount;
     }
 }
 
+/* Nanoseconds since the tool started */
+UINT64 TIME_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (UINT64)ts.tv_sec * 1000000000 + ts.tv_nsec - SampleStart;
+}
 
-/* Calculate the total Counts based all Thread Data. */
-void RL_calculateStatistics(RTN_COUNT *rl, thread_data_t *tl) {
-    for(RTN_COUNT *rc = rl; rc; rc = rc->_next) {
-        for(thread_data_t *td = TdList; td; td = td->_next) {
-            for (RTN_COUNT * trc = td->RtnList; trc; trc = trc->_next) {
-                if (rc->_name == trc->_name) {
-                    rc->_icount += trc->_icount;
-                    rc->_flopcount += trc->_flopcount;
-                    for(int i=0; i<XED_IFORM_LAST; i++) {
-                        if(trc->_instable[i]._execount) {
-                            rc->_instable[i]._execount += trc->_instable[i]._execount;
-                            rc->_instable[i]._cmpcount += trc->_instable[i]._cmpcount;
-                            if(trc->_instable[i]._maskcount) {
-                                rc->_instable[i]._maskcount += trc->_instable[i]._maskcount;
-                            }
-                        }
-                    }
-                }
+/* Write the buffered samples of a Thread Data to the -sample_o file. */
+void TL_writeSamples(thread_data_t *tdata) {
+    if( tdata->SampleLen == 0 )
+        return;
+    PIN_GetLock(&sampleLock, tdata->tid+1);
+    SampleOut->write((const char *)tdata->Samples, tdata->SampleLen * sizeof(SAMPLE));
+    PIN_ReleaseLock(&sampleLock);
+    tdata->SampleLen = 0;
+}
+
+/* Sum the instruction and FLOP counts of a routine in a Thread Data while it runs. */
+void RC_sumCounts(const RTN_COUNT *rc, UINT64 *icount, UINT64 *flopcount) {
+    *icount = 0;
+    *flopcount = 0;
+    for(UINT64 i=0; i<rc->_inslen; i++) {
+        if(rc->_instable[i]._execount) {
+            *icount += rc->_instable[i]._execount;
+            *flopcount += IFORM_cmpCount(i, &rc->_instable[i], true);
+        }
+    }
+}
+
+/* Sample the routines of a Thread Data whose counts changed since their last sample. */
+/* The cost depends on the number of routines and iforms, not on the instructions since the last sample. */
+void TL_takeSample(thread_data_t *tdata) {
+    UINT64 now = TIME_ns();
+    for(RTN_COUNT *rc = tdata->RtnList; rc; rc = rc->_next) {
+        UINT64 icount, flopcount;
+        RC_sumCounts(rc, &icount, &flopcount);
+        if( icount == rc->_sampled )
+            continue;
+        rc->_sampled = icount;
+
+        if( tdata->SampleLen == KnobSampleBuf )
+            TL_writeSamples(tdata);
+        SAMPLE *sp = &tdata->Samples[tdata->SampleLen++];
+        sp->_time = now;
+        sp->_tid = tdata->tid;
+        sp->_rtn = rc->_id;
+        sp->_icount = icount;
+        sp->_flopcount = flopcount;
+    }
+}
+
+
+/* CLOCK_MONOTONIC ns of the -live file */
+UINT64 LIVE_now() {
+    return TIME_ns() + SampleStart;
+}
+
+/* Create and map the -live file, see live_counters.H for its layout. */
+bool LIVE_open() {
+    UINT32 rtnMax = KnobLiveRtn;
+    UINT32 threadMax = KnobLiveThreads + 1;
+    UINT64 size = LIVE_fileSize(rtnMax, threadMax);
+    int fd = open(KnobLiveFile.Value().c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if( fd < 0 )
+        return false;
+    if( ftruncate(fd, size) != 0 ) {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if( map == MAP_FAILED )
+        return false;
+
+    /* The file is all zero: no routine, all slots free */
+    LiveHdr = (LIVE_HEADER *)map;
+    LiveHdr->_version = LIVE_VERSION;
+    LiveHdr->_pid = getpid();
+    LiveHdr->_rtnMax = rtnMax;
+    LiveHdr->_threadMax = threadMax;
+    LiveHdr->_slotSize = LIVE_slotSize(rtnMax);
+    LiveHdr->_slotOffset = LIVE_fileSize(rtnMax, 0);
+    LIVE_slot(LiveHdr, 0)->_state = LIVE_EXITED;
+    /* The magic last, so that a reader never sees a half-written header */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(LiveHdr->_magic, LIVE_MAGIC, 8);
+    return true;
+}
+
+/* Name a routine ID in the -live file before the readers see it. */
+/* _lost is also counted by TL_attachLive under liveLock, so both add to it atomically. */
+void LIVE_nameRoutine(RTN_COUNT *rc) {
+    if( rc->_id >= LiveHdr->_rtnMax ) {
+        __sync_fetch_and_add(&LiveHdr->_lost, 1);
+        return;
+    }
+    string name = rc->_image + ":" + rc->_name;
+    strncpy(LIVE_name(LiveHdr, rc->_id), name.c_str(), LIVE_NAME_LEN - 1);
+    __atomic_store_n(&LiveHdr->_rtnNum, rc->_id + 1, __ATOMIC_RELEASE);
+}
+
+/* Give a new Thread Data a -live slot, none if they ran out */
+void TL_attachLive(thread_data_t *tdata) {
+    UINT32 s = 0;
+    PIN_GetLock(&liveLock, tdata->tid+1);
+    if( !LiveFree.empty() ) {
+        s = LiveFree.back();
+        LiveFree.pop_back();
+    }
+    else if( LiveNext < LiveHdr->_threadMax )
+        s = LiveNext++;
+    else
+        __sync_fetch_and_add(&LiveHdr->_lost, 1);
+    PIN_ReleaseLock(&liveLock);
+    if( s == 0 )
+        return;
+
+    LIVE_SLOT *slot = LIVE_slot(LiveHdr, s);
+    LIVE_beginWrite(&slot->_seq);
+    slot->_tid = tdata->tid;
+    slot->_state = LIVE_RUNNING;
+    slot->_time = LIVE_now();
+    LIVE_endWrite(&slot->_seq);
+    tdata->Live = slot;
+}
+
+/* Publish the counts of a Thread Data to its -live slot, at every -live_ms tick. */
+/* Only the thread writes its slot and the readers only read it, */
+/* so the counters themselves stay unsynchronized. */
+void TL_publishLive(thread_data_t *tdata) {
+    LIVE_SLOT *slot = tdata->Live;
+    if( slot == 0 )
+        return;
+    LIVE_COUNT *counts = LIVE_counts(slot);
+    UINT32 num = std::min(RtnNum, LiveHdr->_rtnMax);
+
+    LIVE_beginWrite(&slot->_seq);
+    for(UINT32 r=0; r<num; r++) {
+        counts[r]._icount = 0;
+        counts[r]._flopcount = 0;
+    }
+    slot->_icount = 0;
+    slot->_flopcount = 0;
+    for(RTN_COUNT *rc = tdata->RtnList; rc; rc = rc->_next) {
+        UINT64 icount, flopcount;
+        RC_sumCounts(rc, &icount, &flopcount);
+        slot->_icount += icount;
+        slot->_flopcount += flopcount;
+        if( rc->_id < num ) {
+            counts[rc->_id]._icount += icount;
+            counts[rc->_id]._flopcount += flopcount;
+        }
+    }
+    slot->_time = LIVE_now();
+    LIVE_endWrite(&slot->_seq);
+    LiveHdr->_updated = slot->_time;
+}
+
+/* Move the final counts of an exiting Thread Data from its -live slot to slot 0 */
+/* and free its slot. TL_calculateStatistics has summed the counts of its routines. */
+void TL_detachLive(thread_data_t *tdata) {
+    LIVE_SLOT *retired = LIVE_slot(LiveHdr, 0);
+    LIVE_COUNT *counts = LIVE_counts(retired);
+    PIN_GetLock(&liveLock, tdata->tid+1);
+    LIVE_beginWrite(&LiveHdr->_seq);
+
+    LIVE_beginWrite(&retired->_seq);
+    for(RTN_COUNT *rc = tdata->RtnList; rc; rc = rc->_next) {
+        retired->_icount += rc->_icount;
+        retired->_flopcount += rc->_flopcount;
+        if( rc->_id < LiveHdr->_rtnMax ) {
+            counts[rc->_id]._icount += rc->_icount;
+            counts[rc->_id]._flopcount += rc->_flopcount;
+        }
+    }
+    retired->_time = LIVE_now();
+    LIVE_endWrite(&retired->_seq);
+
+    LIVE_SLOT *slot = tdata->Live;
+    if( slot ) {
+        LIVE_beginWrite(&slot->_seq);
+        memset(LIVE_counts(slot), 0, LiveHdr->_slotSize - sizeof(LIVE_SLOT));
+        slot->_icount = 0;
+        slot->_flopcount = 0;
+        slot->_state = LIVE_FREE;
+        LIVE_endWrite(&slot->_seq);
+        LiveFree.push_back(((char *)slot - (char *)LiveHdr - LiveHdr->_slotOffset) / LiveHdr->_slotSize);
+        tdata->Live = 0;
+    }
+
+    LIVE_endWrite(&LiveHdr->_seq);
+    LiveHdr->_updated = retired->_time;
+    PIN_ReleaseLock(&liveLock);
+}
+
+/* Calculate the Counts of the counted images (-img) and of their routines. */
+/* The target routines count for the image they are in. */
+void IL_calculateStatistics(IMG_COUNT *il, RTN_COUNT *rl) {
+    for(IMG_COUNT *ic = il; ic; ic = ic->_next) {
+        TL_calculateStatistics(ic->_rtnList, false);
+        for(RTN_COUNT *rc = ic->_rtnList; rc; rc = rc->_next) {
+            ic->_icount += rc->_icount;
+            ic->_flopcount += rc->_flopcount;
+            ic->_rbytes += rc->_rbytes;
+            ic->_wbytes += rc->_wbytes;
+        }
+        for(RTN_COUNT *rc = rl; rc; rc = rc->_next) {
+            if(rc->_image == ic->_name) {
+                ic->_icount += rc->_icount;
+                ic->_flopcount += rc->_flopcount;
+                ic->_rbytes += rc->_rbytes;
+                ic->_wbytes += rc->_wbytes;
             }
         }
     }
 }
 
+/* Add the counts of a Thread Data to the total counts of their routine IDs. */
+/* Every thread merges at its ThreadFini, so the threads merge in parallel, */
+/* and the cost is linear in the counters of the thread. */
+void TL_mergeCounts(thread_data_t *tdata) {
+    for(RTN_COUNT *trc = tdata->RtnList; trc; trc = trc->_next) {
+        RTN_COUNT *rc = trc->_global;
+        PIN_LOCK *lock = &mergeLock[trc->_id % MERGE_SHARDS];
+        PIN_GetLock(lock, tdata->tid+1);
+        RC_growCountTable(rc);
+        rc->_rtnCount += trc->_rtnCount;
+        rc->_icount += trc->_icount;
+        rc->_flopcount += trc->_flopcount;
+        rc->_rbytes += trc->_rbytes;
+        rc->_wbytes += trc->_wbytes;
+        for(UINT64 i=0; i<trc->_inslen; i++) {
+            INS_COUNT *tic = &trc->_instable[i];
+            if( tic->_execount == 0 && tic->_rbytes == 0 && tic->_wbytes == 0 )
+                continue;
+            INS_COUNT *ic = &rc->_instable[i];
+            ic->_execount += tic->_execount;
+            ic->_cmpcount += tic->_cmpcount;
+            ic->_maskcount += tic->_maskcount;
+            ic->_rbytes += tic->_rbytes;
+            ic->_wbytes += tic->_wbytes;
+        }
+        PIN_ReleaseLock(lock);
+    }
+}
+
+/* Add the hotspot counters of a Thread Data to SpotTable and reset them (-hotspots). */
+void TL_mergeSpots(thread_data_t *tdata) {
+    UINT64 *spotcount = tdata->BblCount + SpotBase;
+    UINT32 num = SpotNum;
+    PIN_GetLock(&spotLock, tdata->tid+1);
+    for(UINT32 s=0; s<num; s++) {
+        SpotTable[s]._count += spotcount[s];
+        spotcount[s] = 0;
+    }
+    PIN_ReleaseLock(&spotLock);
+}
+
+/* OS name of a thread, as set by pthread_setname_np or prctl(PR_SET_NAME) */
+string TL_threadName(OS_THREAD_ID ostid) {
+    std::ifstream comm(("/proc/self/task/" + decstr(ostid) + "/comm").c_str());
+    string name;
+    std::getline(comm, name);
+    return name;
+}
+
+bool THREAD_isNamed(const string &name) {
+    for(UINT32 i=0; i<KnobThreadName.NumberOfValues(); i++)
+        if( !KnobThreadName.Value(i).empty() && GLOB_match(KnobThreadName.Value(i).c_str(), name.c_str()) )
+            return true;
+    return false;
+}
+
+/* Keep the routine counts of an exiting Thread Data for the report if the thread is named */
+/* by -thread_name or is among the -thread_top threads with the most FLOP so far. */
+/* A kept -thread_top thread may push out the one with the least FLOP. */
+/* The caller holds pinLock. */
+void TL_keepDetail(thread_data_t *tdata, const string &name) {
+    THREAD_COUNT *tc = new THREAD_COUNT;
+    tc->_tid = tdata->tid;
+    tc->_name = name;
+    tc->_named = THREAD_isNamed(name);
+    tc->_icount = 0;
+    tc->_flopcount = 0;
+    for(RTN_COUNT *rc = tdata->RtnList; rc; rc = rc->_next) {
+        tc->_icount += rc->_icount;
+        tc->_flopcount += rc->_flopcount;
+    }
+
+    if( !tc->_named ) {
+        if( ThdTop == KnobThreadTop ) {
+            THREAD_COUNT **least = 0;
+            for(THREAD_COUNT **tp = &ThdList; *tp; tp = &(*tp)->_next)
+                if( !(*tp)->_named && (least == 0 || (*tp)->_flopcount < (*least)->_flopcount) )
+                    least = tp;
+            if( least == 0 || (*least)->_flopcount >= tc->_flopcount ) {
+                delete tc;
+                return;
+            }
+            THREAD_COUNT *drop = *least;
+            *least = drop->_next;
+            RC_deleteList(drop->_rtnList);
+            delete drop;
+            ThdTop--;
+        }
+        ThdTop++;
+    }
+
+    tc->_rtnLen = tdata->RtnList_len;
+    tc->_rtnList = tdata->RtnList;
+    tdata->RtnList = 0;
+    tdata->RtnList_len = 0;
+    tc->_next = ThdList;
+    ThdList = tc;
+}
+
+/* Unlink an exited Thread Data from TdList, deallocate its routine counts */
+/* and put it with its tables into TdPool for the next thread. */
+/* The caller holds pinLock. */
+void TL_release(thread_data_t *tdata) {
+    for(thread_data_t **tp = &TdList; *tp; tp = &(*tp)->_next) {
+        if( *tp == tdata ) {
+            *tp = tdata->_next;
+            break;
+        }
+    }
+    RC_deleteList(tdata->RtnList);
+    tdata->RtnList = 0;
+    tdata->RtnList_len = 0;
+    tdata->RtnCur = 0;
+    tdata->RtnPending = 0;
+    for(UINT64 i=0; i<tdata->RtnSlot_len; i++) {
+        tdata->RtnSlot[i] = 0;
+        tdata->RtnCalls[i] = 0;
+    }
+    tdata->SampleLen = 0;
+    tdata->_next = TdPool;
+    TdPool = tdata;
+}
+
+/* Deallocate a list of Thread Data with their tables */
+void TL_deleteList(thread_data_t *tl) {
+    for(thread_data_t *td = tl; td;) {
+        thread_data_t *td_cur = td;
+        RC_deleteList(td->RtnList);
+        free(td->BblCount);
+        delete [] td->BblTouched;
+        delete [] td->Samples;
+        delete [] td->RtnSlot;
+        RTN_deleteCallTable(td->RtnCalls);
+        td = td->_next;
+        delete td_cur;
+    }
+}
+
 /* ===================================================================== */
 // Analysis routines
 /* ===================================================================== */
 
-/* Count the number of executed routines in the target image. */
-/* Dynamically allocate memories for every executed routines and conduct necessary initializations. */
-VOID PIN_FAST_ANALYSIS_CALL routine_counter_mt(UINT64 * counter, string *rtn_name, THREADID threadid) {
-    PIN_GetLock(&pinLock, threadid+1);
-    (*counter)++;   // This is global variable, so it needs lock. 
-    PIN_ReleaseLock(&pinLock);
-
-    /* TODO: Bug */
-    /* There is an inaccurate count of instructions */
-    /* when a switch between caller and callee (routines) is happened */
-    thread_data_t* tdata = get_tls(threadid);
+/* Allocate the counts of a target routine in a Thread Data. */
+RTN_COUNT *TL_newRoutineCount(RTN_COUNT *grc, thread_data_t *tdata) {
     RTN_COUNT *rc = new RTN_COUNT;
-    rc->_instable = new INS_COUNT[XED_IFORM_LAST];
+    rc->_inslen = IformNum;
+    rc->_instable = INS_newCountTable(rc->_inslen);
+    rc->_id = grc->_id;
+    rc->_global = grc;
+    rc->_rtnCount = 0;
     rc->_icount = 0;
     rc->_flopcount = 0;
-    rc->_name = *rtn_name;
-    for (int i=0; i<XED_IFORM_LAST; i++ ) {
-        rc->_instable[i]._execount = 0;
-        rc->_instable[i]._cmpcount = 0;
+    rc->_rbytes = 0;
+    rc->_wbytes = 0;
+    rc->_sampled = 0;
+    rc->_name = grc->_name;
+    rc->_next = tdata->RtnList;
+    tdata->RtnList = rc;
+    tdata->RtnList_len += 1;
+    return rc;
+}
+
+/* Switch the thread to the counter slot of a routine, which is allocated on the first call only, */
+/* and add calls to the routine. With -per_call, a new counter is allocated for every call instead. */
+/* Returns the INS_COUNT table of the routine, which becomes the new value of RegInsTable. */
+ADDRINT TL_switchRoutine(thread_data_t *tdata, RTN_COUNT *grc, UINT64 calls) {
+    tdata->RtnPending = 0;
+
+    /* Only this thread touches its slots, so they can grow here without a lock */
+    if(grc->_id >= tdata->RtnSlot_len) {
+        UINT64 len = RtnNum;
+        RTN_COUNT **slot = new RTN_COUNT *[len];
+        UINT64 *table = RTN_newCallTable(len);
+        for(UINT64 i=0; i<tdata->RtnSlot_len; i++) {
+            slot[i] = tdata->RtnSlot[i];
+            table[i] = tdata->RtnCalls[i];
+        }
+        for(UINT64 i=tdata->RtnSlot_len; i<len; i++)
+            slot[i] = 0;
+        delete [] tdata->RtnSlot;
+        RTN_deleteCallTable(tdata->RtnCalls);
+        tdata->RtnSlot = slot;
+        tdata->RtnCalls = table;
+        tdata->RtnSlot_len = len;
     }
+
+    /* The calls are counted per thread and summed in TL_mergeCounts, */
+    /* so threads calling the same routine neither lock nor share a cache line */
+    tdata->RtnCalls[grc->_id] += calls;
+
+    /* TODO: Bug */
+    /* There is an inaccurate count of instructions */
+    /* when a switch between caller and callee (routines) is happened */
+    /* The BBLs executed so far belong to the previous routine */
+    if(tdata->BblCount)
+        TL_flushBblCounts(tdata);
+
     /* For example: main -> multiplyMatrix -> main */
     /* After the callee "multiplyMatrix" finished and then the routine switches back to "main", */
     /* the following instructons in "main" will be counted in "multiplyMatrix". */
     /* These codes is the factor causing this problem. */
-    rc->_next = tdata->RtnList;
-    tdata->RtnList = rc;
-    tdata->RtnList_len += 1;
+    if(KnobPerCall) {
+        RTN_COUNT *rc = TL_newRoutineCount(grc, tdata);
+        rc->_rtnCount = calls;
+        tdata->RtnCur = rc;
+        return (ADDRINT)rc->_instable;
+    }
+
+    RTN_COUNT *rc = tdata->RtnSlot[grc->_id];
+    if(rc == 0) {
+        rc = TL_newRoutineCount(grc, tdata);
+        tdata->RtnSlot[grc->_id] = rc;
+    }
+    /* The iforms of every routine this thread can reach until its next routine entry */
+    /* have been indexed by now, so the table only needs to grow here. */
+    RC_growCountTable(rc);
+    tdata->RtnCur = rc;
+    return (ADDRINT)rc->_instable;
+}
+
+/* Count the number of executed routines in the target image. */
+/* While the thread does not count (-control), the routine is only remembered, without a flush */
+/* or a new slot: counting_resume switches to it when the thread counts again. */
+/* Returns the INS_COUNT table of the routine, which becomes the new value of RegInsTable. */
+ADDRINT PIN_FAST_ANALYSIS_CALL routine_counter_mt(RTN_COUNT *grc, THREADID threadid) {
+    thread_data_t* tdata = get_tls(threadid);
+    if(!tdata->Counting) {
+        tdata->RtnPending = grc;
+        return 0;
+    }
+    return TL_switchRoutine(tdata, grc, 1);
+}
+
+/* Load the counting state of the thread into RegCounting at the head of every trace, */
+/* the version case right after it switches the trace version. */
+ADDRINT PIN_FAST_ANALYSIS_CALL counting_sync(thread_data_t *tdata) {
+    return tdata->Counting;
+}
+
+/* Switch to the routine entered last while the thread did not count, once it counts again */
+/* (at the head of a VERSION_OFF trace). The call itself was not counted. */
+/* Returns the new value of RegInsTable. */
+ADDRINT counting_resume(thread_data_t *tdata) {
+    if( tdata->RtnPending )
+        return TL_switchRoutine(tdata, tdata->RtnPending, 0);
+    return (ADDRINT)(tdata->RtnCur ? tdata->RtnCur->_instable : 0);
+}
+
+/* Count down the instructions to the next sample of a thread (-sample_*). */
+/* The timer thread sets SampleLeft to 0 to force a sample at the next check. */
+ADDRINT PIN_FAST_ANALYSIS_CALL sample_countdown(thread_data_t *tdata, UINT32 count) {
+    tdata->SampleLeft -= count;
+    return tdata->SampleLeft <= 0;
+}
+
+/* Take a sample of a thread and publish its -live counts, once per sampling interval. */
+/* The flush may grow the table of the current routine, so it is returned as the new RegInsTable. */
+ADDRINT sample_take(thread_data_t *tdata) {
+    tdata->SampleLeft = KnobSampleIcount ? (INT64)KnobSampleIcount.Value() : INT64_MAX;
+    if( tdata->BblCount )
+        TL_flushBblCounts(tdata);
+    if( SampleMode )
+        TL_takeSample(tdata);
+    if( LiveMode )
+        TL_publishLive(tdata);
+    return (ADDRINT)(tdata->RtnCur ? tdata->RtnCur->_instable : 0);
 }
 
 /* Calculate execution count of an instruction in the current routine of each thread. */
-VOID PIN_FAST_ANALYSIS_CALL instruction_counter_mt(xed_iform_enum_t iform, THREADID threadid) {
-    thread_data_t *tdata = get_tls(threadid);
-    tdata->RtnList->_instable[iform]._execount++;
+/* The table comes from RegInsTable, so Pin can inline this function. */
+VOID PIN_FAST_ANALYSIS_CALL instruction_counter_mt(INS_COUNT *instable, UINT32 iform) {
+    instable[iform]._execount++;
+}
+
+/* Calculate execution count and memory bytes of an instruction with fixed-size memory accesses. */
+VOID PIN_FAST_ANALYSIS_CALL instruction_counter_mem(INS_COUNT *instable, UINT32 iform, UINT32 rbytes, UINT32 wbytes) {
+    instable[iform]._execount++;
+    instable[iform]._rbytes += rbytes;
+    instable[iform]._wbytes += wbytes;
+}
+
+/* Add the static number of instructions and memory bytes of a run to an iform (-flop_only). */
+VOID PIN_FAST_ANALYSIS_CALL instruction_counter_add(INS_COUNT *instable, UINT32 iform, UINT32 count, UINT32 rbytes, UINT32 wbytes) {
+    instable[iform]._execount += count;
+    instable[iform]._rbytes += rbytes;
+    instable[iform]._wbytes += wbytes;
+}
+
+/* Add the bytes of the active elements of a gather, scatter or masked memory access. */
+VOID PIN_FAST_ANALYSIS_CALL docount_MemMulti(INS_COUNT *instable, UINT32 iform, PIN_MULTI_MEM_ACCESS_INFO *info) {
+    for(UINT32 i=0; i<info->numberOfMemops; i++) {
+        if( !info->memop[i].maskOn )
+            continue;
+        if( info->memop[i].memopType == PIN_MEMOP_LOAD )
+            instable[iform]._rbytes += info->memop[i].bytesAccessed;
+        else
+            instable[iform]._wbytes += info->memop[i].bytesAccessed;
+    }
+}
+
+/* Calculate execution count of a BBL in each thread. */
+/* The counters come from RegBblCount, so Pin can inline this function. */
+VOID PIN_FAST_ANALYSIS_CALL bbl_counter_mt(UINT64 *bblcount, UINT32 bblid) {
+    bblcount[bblid]++;
+}
+
+/* The same for a BBL of the target routines, true on its first run since the last flush, */
+/* so that bbl_touch records its ID for TL_flushBblCounts. */
+ADDRINT PIN_FAST_ANALYSIS_CALL bbl_counter_first(UINT64 *bblcount, UINT32 bblid) {
+    return bblcount[bblid]++ == 0;
+}
+
+VOID PIN_FAST_ANALYSIS_CALL bbl_touch(thread_data_t *tdata, UINT32 bblid) {
+    tdata->BblTouched[tdata->BblTouchedLen++] = bblid;
 }
 
-/* TODO: need test with AVX512 Masking instructions */
 /* This function is for Masking Instructions */
-VOID PIN_FAST_ANALYSIS_CALL docount_MaskOP(UINT64 iform, REG reg, const CONTEXT *ctxt, THREADID threadid) {
-    thread_data_t* tdata = get_tls(threadid);
-    UINT64 value = PIN_GetContextReg(ctxt, reg);
-    tdata->RtnList->_instable[iform]._maskcount += CountOnes(value);
+/* The mask register comes by value and only the lanes of the vector length are counted. */
+/* The target attribute lets the compiler emit POPCNT, so Pin can inline this function. */
+__attribute__((target("popcnt")))
+VOID PIN_FAST_ANALYSIS_CALL docount_MaskOP(INS_COUNT *instable, UINT32 index, ADDRINT mask, ADDRINT lanes) {
+    instable[index]._maskcount += __builtin_popcountll(mask & lanes);
+}
+
+/* Masking Instructions with k0 (or without a mask) compute every lane, no register read needed */
+VOID PIN_FAST_ANALYSIS_CALL docount_MaskOP_k0(INS_COUNT *instable, UINT32 index, UINT32 elements) {
+    instable[index]._maskcount += elements;
 }
 
 
@@ -335,96 +1558,493 @@ VOID PIN_FAST_ANALYSIS_CALL docount_MaskOP(UINT64 iform, REG reg, const CONTEXT
 // Instrumentation callbacks
 /* ===================================================================== */
 
-VOID Image(IMG img, VOID *v) {
-    INFOS printf( "[INFOS] Image Name: %s, Target Name: %s, %d\n", 
-        StripPath(IMG_Name(img).c_str()), target_image, strcmp(StripPath(IMG_Name(img).c_str()), target_image) );
-    if( strcmp(StripPath(IMG_Name(img).c_str()), target_image) == 0 ) {
-        for( SEC sec = IMG_SecHead(img); SEC_Valid(sec); sec = SEC_Next(sec) ) {
-            for( RTN rtn= SEC_RtnHead(sec); RTN_Valid(rtn); rtn = RTN_Next(rtn) ) {
-                // DEBUG printf("    [DEBUG] Routine decorated Name: %s\n", (RTN_Name(rtn).c_str())); 
-                // DEBUG printf("        [DEBUG] Full Routine Name: %s\n", PIN_UndecorateSymbolName(RTN_Name(rtn), UNDECORATION_COMPLETE).c_str()); 
-                // DEBUG printf("        [DEBUG] Only Routine Name: %s\n", PIN_UndecorateSymbolName(RTN_Name(rtn), UNDECORATION_NAME_ONLY).c_str()); 
-                // DEBUG printf("        [DEBUG] Stripped Routine Name: %s\n", StripName(PIN_UndecorateSymbolName(RTN_Name(rtn), UNDECORATION_NAME_ONLY).c_str())); 
-
-                /* Instrument the multiplyMatrix() and multiplySparseMatrix() functions. */
-                if ( RTN_isTargetRoutine(rtn) ) {
-                    INFOS printf("        [INFOS] Decorated Routine Name: %s\n", RTN_Name(rtn).c_str());
-                    // DEBUG printf("        [DEBUG] Undecorated Routine Name: %s\n", functionName.c_str());
-
-                    /* Allocate a counter for this routine */
-                    RTN_COUNT * rc = new RTN_COUNT;
-                    INS_COUNT *instb = new INS_COUNT[XED_IFORM_LAST];
-                    for (int i=0; i<XED_IFORM_LAST; i++ ) {
-                        instb[i]._execount = 0;
-                        instb[i]._cmpcount = 0;
-                        instb[i]._maskcount = 0;
-                    }
+/* Allocate the counts of a target routine and count its calls. */
+/* The routine is left open for the caller to index its iforms. */
+RTN_COUNT *RTN_addTarget(RTN rtn) {
+    INFOS *info << "        [INFOS] Decorated Routine Name: " << RTN_Name(rtn) << endl;
+
+    /* Allocate a counter for this routine */
+    /* Its INS_COUNT table is allocated in Fini, when all iforms are known */
+    RTN_COUNT * rc = new RTN_COUNT;
+
+    /* The RTN goes away when the image is unloaded, so save it now */
+    /* because we need it in the fini */
+    rc->_id = RtnNum++;
+    rc->_name = RTN_Name(rtn);
+    rc->_image = StripPath(IMG_Name(SEC_Img(RTN_Sec(rtn))).c_str());
+    rc->_address = RTN_Address(rtn);
+    rc->_size = RTN_Size(rtn);
+    rc->_icount = 0;
+    rc->_rtnCount = 0;
+    rc->_flopcount = 0;
+    rc->_rbytes = 0;
+    rc->_wbytes = 0;
+    rc->_inslen = 0;
+    rc->_instable = 0;
+    rc->_sampled = 0;
+    rc->_global = 0;
+
+    /* Add to list of routines */
+    rc->_next = RtnList;
+    RtnList = rc;
+    RtnMap[rc->_address] = rc;
+    if( LiveMode )
+        LIVE_nameRoutine(rc);
+
+    RTN_Open(rtn);
+
+    /* The function - routine_counter_mt - is called before every routine is executed */
+    /* It has to run before the counters of the first instruction (see Trace) */
+    RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)routine_counter_mt, IARG_FAST_ANALYSIS_CALL,
+        IARG_CALL_ORDER, CALL_ORDER_FIRST,
+        IARG_PTR, rc, IARG_THREAD_ID,
+        IARG_RETURN_REGS, RegInsTable, IARG_END);
+    return rc;
+}
 
-                    /* The RTN goes away when the image is unloaded, so save it now */
-                    /* because we need it in the fini */
-                    rc->_name = RTN_Name(rtn);
-                    rc->_image = StripPath(IMG_Name(SEC_Img(RTN_Sec(rtn))).c_str());
-                    rc->_address = RTN_Address(rtn);
-                    rc->_icount = 0;
-                    rc->_rtnCount = 0;
-                    rc->_flopcount = 0;
-                    rc->_instable = instb;
-
-                    /* Add to list of routines */
-                    rc->_next = RtnList;
-                    RtnList = rc;
-
-                    RTN_Open(rtn);
-
-                    /* The function - routine_counter_mt - is called before every routine is executed */
-                    RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)routine_counter_mt, IARG_FAST_ANALYSIS_CALL,
-                        IARG_PTR, &(rc->_rtnCount), IARG_PTR, &(rc->_name), IARG_THREAD_ID, IARG_END);
-
-                    /* For each instruction of the routine */
-                    for ( INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins) ) {
-                        xed_decoded_inst_t* xedd = INS_XedDec(ins);
-                        xed_iform_enum_t iform = xed_decoded_inst_get_iform_enum(xedd);
-
-                        /* Store the basic information of instuctions in the (INS_ATTR) insAttr */
-                        if( insAttr[iform]._xedd == NULL ) {
-                            insAttr[iform]._xedd = new xed_decoded_inst_t;
-                            *(insAttr[iform]._xedd) = *xedd;
-                            insAttr[iform]._iclass = xed_decoded_inst_get_iclass(xedd);
-                            insAttr[iform]._cat = xed_decoded_inst_get_category(xedd);
-                            insAttr[iform]._ext = xed_decoded_inst_get_extension(xedd);
-                            insAttr[iform]._opdno = xed_decoded_inst_noperands(xedd);
-                            insAttr[iform]._elemno = xed_decoded_inst_operand_elements(xedd, 0);
-                            insAttr[iform]._isFLOP = XEDD_isFLOP(xedd);
-                            insAttr[iform]._isFMA = XEDD_isFMA(xedd);
-                            insAttr[iform]._isScalarSimd = XEDD_isScalarSimd(xedd);
-                            insAttr[iform]._isMaskOP = XEDD_isMaskOP(xedd);
-                        }
-
-                        /* The function - instruction_counter_mt - is called before every instruction is executed */
-                        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)instruction_counter_mt, IARG_FAST_ANALYSIS_CALL, 
-                            IARG_UINT64, iform, IARG_THREAD_ID, IARG_END);
-
-                        /* TODO: need test with AVX512 Masking instructions */
-                        if( insAttr[iform]._isMaskOP ) {
-                            const xed_inst_t* xedi = xedd->_inst;
-                            for(int j=0; j<xedi->_noperands; j++) {
-                                const xed_operand_t* op = xed_inst_operand(xedi, j);
-                                xed_operand_enum_t op_enum = xed_operand_name(op);
-                                xed_reg_enum_t reg_enum = xed_decoded_inst_get_reg(xedd, op_enum);
-                                if( reg_enum >= XED_REG_MASK_FIRST && reg_enum <= XED_REG_MASK_LAST ) {
-                                    REG reg = INS_XedExactMapToPinReg(reg_enum);
-                                    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)docount_MaskOP, IARG_FAST_ANALYSIS_CALL, 
-                                        IARG_UINT64, iform, IARG_UINT32, reg, IARG_CONTEXT, IARG_THREAD_ID, IARG_END);
-                                }
-                            }
-                        }
-                    }
+/* Find the loops of an open target routine by its back-edges: direct jumps to an earlier */
+/* address of the routine. The back-edges to the same header make one loop (-loops). */
+VOID RTN_findLoops(RTN rtn, RTN_COUNT *rc) {
+    std::map<ADDRINT, ADDRINT> loops;
+    for( INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins) ) {
+        if( !INS_IsDirectBranch(ins) || INS_IsCall(ins) )
+            continue;
+        ADDRINT addr = INS_Address(ins);
+        ADDRINT target = INS_DirectControlFlowTargetAddress(ins);
+        if( target < rc->_address || target > addr )
+            continue;
+        ADDRINT &end = loops[target];
+        end = std::max(end, addr);
+    }
+
+    for(std::map<ADDRINT, ADDRINT>::iterator it = loops.begin(); it != loops.end(); ++it) {
+        LOOP loop;
+        loop._header = it->first;
+        loop._end = it->second;
+        loop._rtn = rc;
+        loop._slot = SPOT_NONE;
+        loop._depth = 0;
+        loop._iterations = 0;
+        loop._flopcount = 0;
+        INT32 column = 0;
+        string file;
+        PIN_GetSourceLocation(loop._header, &column, &loop._line, &file);
+        loop._file = &*SpotFiles.insert(file).first;
+        LoopHeaders[loop._header] = LoopList.size();
+        LoopList.push_back(loop);
+    }
+}
+
+/* Instrument the target routines of an image from its cache file (-cache_dir). */
+/* Returns false, with nothing instrumented, if a cached routine is not found in the image. */
+bool IMG_addCachedTargets(IMG img, const IMAGE_CACHE &cache) {
+    ADDRINT low = IMG_LowAddress(img);
+    std::vector<RTN> rtns;
+    for(UINT32 r=0; r<cache.RoutineNum(); r++) {
+        const CACHE_ROUTINE &cr = cache.Routine(r);
+        RTN rtn = RTN_FindByAddress(low + cr._offset);
+        if( !RTN_Valid(rtn) || RTN_Address(rtn) != low + cr._offset || RTN_Size(rtn) != cr._size
+            || RTN_Name(rtn) != cache.Name(r) )
+            return false;
+        rtns.push_back(rtn);
+    }
+    for(UINT32 r=0; r<rtns.size(); r++) {
+        RTN_COUNT *rc = RTN_addTarget(rtns[r]);
+        for(UINT32 i=0; i<cache.Routine(r)._iformNum; i++)
+            IFORM_getIndex(cache.Iform(r, i));
+        if( KnobLoops )
+            RTN_findLoops(rtns[r], rc);
+        RTN_Close(rtns[r]);
+    }
+    return true;
+}
 
-                    RTN_Close(rtn);
+VOID Image(IMG img, VOID *v) {
+    bool mainImage = IMG_IsMainExecutable(img);
+    INFOS *info << "[INFOS] Image Name: " << StripPath(IMG_Name(img).c_str()) << ", Target Name: " << target_image
+                << ", " << mainImage << endl;
+    bool counted = ImgMode && IMG_isCountedImage(img);
+    if( counted ) {
+        /* The code outside the target routines is counted per BBL in Trace */
+        IMG_COUNT *ic = new IMG_COUNT;
+        ic->_name = StripPath(IMG_Name(img).c_str());
+        ic->_low = IMG_LowAddress(img);
+        ic->_high = IMG_HighAddress(img);
+        ic->_icount = 0;
+        ic->_flopcount = 0;
+        ic->_rbytes = 0;
+        ic->_wbytes = 0;
+        ic->_rtnList = 0;
+        ic->_next = ImgList;
+        ImgList = ic;
+        ImgMap[ic->_low] = ic;
+    }
+    if( !counted && !mainImage )
+        return;
+
+    /* The same build with the same targets has the same target routines and iforms */
+    UINT64 key = 0, size = IMG_HighAddress(img) - IMG_LowAddress(img);
+    string cachefile;
+    bool cached = !KnobCacheDir.Value().empty() && CACHE_imageKey(IMG_Name(img), &key, &cachefile);
+    if( cached ) {
+        cachefile = KnobCacheDir.Value() + "/" + cachefile;
+        IMAGE_CACHE cache;
+        if( cache.Open(cachefile, key, TargetHash, size) && IMG_addCachedTargets(img, cache) ) {
+            *info << "* Image cache " << cachefile << ": " << cache.RoutineNum() << " target routines" << endl;
+            return;
+        }
+    }
+
+    IMAGE_CACHE_WRITER writer;
+    for( SEC sec = IMG_SecHead(img); SEC_Valid(sec); sec = SEC_Next(sec) ) {
+        for( RTN rtn= SEC_RtnHead(sec); RTN_Valid(rtn); rtn = RTN_Next(rtn) ) {
+            // DEBUG printf("    [DEBUG] Routine decorated Name: %s\n", (RTN_Name(rtn).c_str())); 
+            // DEBUG printf("        [DEBUG] Full Routine Name: %s\n", PIN_UndecorateSymbolName(RTN_Name(rtn), UNDECORATION_COMPLETE).c_str()); 
+            // DEBUG printf("        [DEBUG] Only Routine Name: %s\n", PIN_UndecorateSymbolName(RTN_Name(rtn), UNDECORATION_NAME_ONLY).c_str()); 
+            // DEBUG printf("        [DEBUG] Stripped Routine Name: %s\n", StripName(PIN_UndecorateSymbolName(RTN_Name(rtn), UNDECORATION_NAME_ONLY).c_str())); 
+
+            /* Instrument the multiplyMatrix() and multiplySparseMatrix() functions. */
+            if ( RTN_isTargetRoutine(rtn) ) {
+                RTN_COUNT *rc = RTN_addTarget(rtn);
+                writer.AddRoutine(RTN_Address(rtn) - IMG_LowAddress(img), RTN_Size(rtn), RTN_Name(rtn));
+
+                /* For each instruction of the routine */
+                /* The instructions are counted in Trace, where the counters can be switched off */
+                for ( INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins) ) {
+                    xed_iform_enum_t iform = xed_decoded_inst_get_iform_enum(INS_XedDec(ins));
+                    IFORM_getIndex(iform);
+                    writer.AddIform(iform);
                 }
+                if( KnobLoops )
+                    RTN_findLoops(rtn, rc);
+
+                RTN_Close(rtn);
             }
         }
     }
+
+    if( cached ) {
+        bool ok = writer.Write(cachefile, key, TargetHash, size);
+        *info << "* Image cache " << cachefile << (ok ? ": rebuilt" : ": cannot be written") << endl;
+    }
+}
+
+/* Image and Trace, timed for the "* Instrumentation took" message */
+VOID ImageTimed(IMG img, VOID *v) {
+    UINT64 start = TIME_ns();
+    Image(img, v);
+    InstrumentNs += TIME_ns() - start;
+}
+
+/* The addresses of an unloaded image may be reused by the next one */
+/* Its counts stay in ImgList for the report */
+VOID ImageUnload(IMG img, VOID *v) {
+    RtnMap.erase(RtnMap.lower_bound(IMG_LowAddress(img)), RtnMap.upper_bound(IMG_HighAddress(img)));
+    SpotMap.erase(SpotMap.lower_bound(IMG_LowAddress(img)), SpotMap.upper_bound(IMG_HighAddress(img)));
+    LoopHeaders.erase(LoopHeaders.lower_bound(IMG_LowAddress(img)), LoopHeaders.upper_bound(IMG_HighAddress(img)));
+    ImgMap.erase(IMG_LowAddress(img));
+}
+
+/* Allocate a BBL ID for the histogram of a run of instructions and count it at its head. */
+/* The runs of the target routines count for the current routine of the thread, */
+/* the runs of the other code of a counted image (owner) always for their own routine. */
+/* The hotspot slots of the run (spots) are counted with it. */
+VOID INS_insertBblCounter(INS head, std::map<UINT32, HIST_ENTRY> &hist, RTN_COUNT *owner, std::vector<UINT32> *spots = 0) {
+    if( !INS_Valid(head) || hist.empty() )
+        return;
+    if( owner && ImgBblNum >= KnobImgBblMax ) {
+        ImgBblLost++;
+        hist.clear();
+        return;
+    }
+
+    BBL_HIST *bh = new BBL_HIST;
+    bh->_owner = owner;
+    bh->_len = hist.size();
+    bh->_index = new UINT32[bh->_len];
+    bh->_entry = new HIST_ENTRY[bh->_len];
+    UINT32 i = 0;
+    for(std::map<UINT32, HIST_ENTRY>::iterator it = hist.begin(); it != hist.end(); ++it, i++) {
+        bh->_index[i] = it->first;
+        bh->_entry[i] = it->second;
+    }
+    hist.clear();
+    bh->_spotLen = spots ? spots->size() : 0;
+    bh->_spot = bh->_spotLen ? new UINT32[bh->_spotLen] : 0;
+    for(UINT32 k=0; k<bh->_spotLen; k++)
+        bh->_spot[k] = (*spots)[k];
+    if( spots )
+        spots->clear();
+
+    /* Publish the histogram before its ID becomes visible to TL_flushBblCounts */
+    UINT32 bblid;
+    if( owner ) {
+        bblid = ImgBblNum;
+        ImgBblTable[bblid] = bh;
+        ImgBblNum = bblid + 1;
+        bblid += KnobBblMax;
+    }
+    else {
+        bblid = BblNum;
+        BblTable[bblid] = bh;
+        BblNum = bblid + 1;
+    }
+
+    /* The image BBLs are only folded at ThreadFini, the target routine BBLs at every routine entry */
+    if( owner ) {
+        INS_InsertCall(head, IPOINT_BEFORE, (AFUNPTR)bbl_counter_mt, IARG_FAST_ANALYSIS_CALL,
+            IARG_REG_VALUE, RegBblCount, IARG_UINT32, bblid, IARG_END);
+        return;
+    }
+    INS_InsertIfCall(head, IPOINT_BEFORE, (AFUNPTR)bbl_counter_first, IARG_FAST_ANALYSIS_CALL,
+        IARG_REG_VALUE, RegBblCount, IARG_UINT32, bblid, IARG_END);
+    INS_InsertThenCall(head, IPOINT_BEFORE, (AFUNPTR)bbl_touch, IARG_FAST_ANALYSIS_CALL,
+        IARG_REG_VALUE, RegThread, IARG_UINT32, bblid, IARG_END);
+}
+
+/* Give a FLOP instruction or loop header of a target routine its hotspot slot when it is first instrumented, */
+/* with its source line. Returns SPOT_NONE when the slots ran out. */
+UINT32 SPOT_getSlot(INS ins, RTN_COUNT *rc, xed_iform_enum_t iform) {
+    ADDRINT addr = INS_Address(ins);
+    std::map<ADDRINT, UINT32>::iterator it = SpotMap.find(addr);
+    if( it != SpotMap.end() )
+        return it->second;
+    if( SpotNum >= KnobHotspotMax ) {
+        SpotLost++;
+        return SPOT_NONE;
+    }
+
+    SPOT *sp = &SpotTable[SpotNum];
+    sp->_address = addr;
+    sp->_rtn = rc;
+    sp->_iform = iform;
+    sp->_count = 0;
+    INT32 column = 0;
+    string file;
+    PIN_GetSourceLocation(addr, &column, &sp->_line, &file);
+    sp->_file = &*SpotFiles.insert(file).first;
+
+    /* Publish the slot before it becomes visible to TL_mergeSpots */
+    UINT32 slot = SpotNum;
+    SpotNum = slot + 1;
+    SpotMap[addr] = slot;
+    std::map<ADDRINT, UINT32>::iterator lit = LoopHeaders.find(addr);
+    if( lit != LoopHeaders.end() )
+        LoopList[lit->second]._slot = slot;
+    return slot;
+}
+
+/* Count the executions of a hotspot by its own call, for the instructions counted one by one. */
+VOID INS_insertSpotCounter(INS ins, UINT32 slot) {
+    if( slot == SPOT_NONE )
+        return;
+    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)bbl_counter_mt, IARG_FAST_ANALYSIS_CALL,
+        IARG_REG_VALUE, RegBblCount, IARG_UINT32, SpotBase + slot, IARG_END);
+}
+
+/* Count the active lanes of a masked FLOP instruction of a target routine. */
+/* Only the FLOP use the mask count (see TL_calculateStatistics) */
+VOID INS_insertMaskCounter(INS ins, xed_iform_enum_t iform, UINT32 index) {
+    if( !IfmClass._isMaskOP[iform] || !IfmClass._isFLOP[iform] )
+        return;
+    UINT64 elements = IfmClass._elemno[iform];
+    xed_reg_enum_t reg_enum = XEDD_getMaskReg(INS_XedDec(ins));
+    if( reg_enum == XED_REG_INVALID || reg_enum == XED_REG_K0 ) {
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)docount_MaskOP_k0, IARG_FAST_ANALYSIS_CALL, 
+            IARG_REG_VALUE, RegInsTable, IARG_UINT32, index, IARG_UINT32, (UINT32)elements, IARG_END);
+    }
+    else {
+        ADDRINT lanes = (elements >= 64) ? ~(ADDRINT)0 : (((ADDRINT)1 << elements) - 1);
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)docount_MaskOP, IARG_FAST_ANALYSIS_CALL, 
+            IARG_REG_VALUE, RegInsTable, IARG_UINT32, index,
+            IARG_REG_VALUE, INS_XedExactMapToPinReg(reg_enum), IARG_ADDRINT, lanes, IARG_END);
+    }
+}
+
+/* Gathers, scatters and masked accesses move a number of bytes only known at run time. */
+bool INS_hasDynamicMemory(INS ins) {
+    return INS_MemoryOperandCount(ins) > 0
+        && (INS_HasScatteredMemoryAccess(ins) || xed_decoded_inst_masked_vector_operation(INS_XedDec(ins)));
+}
+
+/* Add the static memory bytes of an instruction to a histogram entry, */
+/* which are its operand sizes (for the dynamic accesses, all elements). */
+VOID INS_addMemoryBytes(INS ins, HIST_ENTRY &he) {
+    for(UINT32 i=0; i<INS_MemoryOperandCount(ins); i++) {
+        UINT32 size = INS_MemoryOperandSize(ins, i);
+        if( INS_MemoryOperandIsRead(ins, i) )
+            he._rbytes += size;
+        if( INS_MemoryOperandIsWritten(ins, i) )
+            he._wbytes += size;
+    }
+}
+
+/* Count an instruction of a target routine by its own call, with its memory bytes. */
+VOID INS_insertInsCounter(INS ins, UINT32 index) {
+    HIST_ENTRY he = { 1, 0, 0 };
+    if( INS_hasDynamicMemory(ins) )
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)docount_MemMulti, IARG_FAST_ANALYSIS_CALL,
+            IARG_REG_VALUE, RegInsTable, IARG_UINT32, index, IARG_MULTI_MEMORYACCESS_EA, IARG_END);
+    else
+        INS_addMemoryBytes(ins, he);
+    if( he._rbytes || he._wbytes )
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)instruction_counter_mem, IARG_FAST_ANALYSIS_CALL, 
+            IARG_REG_VALUE, RegInsTable, IARG_UINT32, index, IARG_UINT32, he._rbytes, IARG_UINT32, he._wbytes, IARG_END);
+    else
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)instruction_counter_mt, IARG_FAST_ANALYSIS_CALL, 
+            IARG_REG_VALUE, RegInsTable, IARG_UINT32, index, IARG_END);
+}
+
+/* Add the number and memory bytes of the non-FLOP instructions of a run to index 0 at its head (-flop_only). */
+VOID INS_insertOtherCounter(INS head, HIST_ENTRY &others) {
+    if( INS_Valid(head) && others._count )
+        INS_InsertCall(head, IPOINT_BEFORE, (AFUNPTR)instruction_counter_add, IARG_FAST_ANALYSIS_CALL,
+            IARG_REG_VALUE, RegInsTable, IARG_UINT32, 0, IARG_UINT32, others._count,
+            IARG_UINT32, others._rbytes, IARG_UINT32, others._wbytes, IARG_END);
+    others._count = 0;
+    others._rbytes = 0;
+    others._wbytes = 0;
+}
+
+/* Whether a trace has an instruction of a target routine or of a counted image (-img) */
+bool TRACE_isCounted(TRACE trace) {
+    for( BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl) )
+        for( INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins) )
+            if( RTN_findTargetRoutine(INS_Address(ins)) || (ImgMode && IMG_findImage(INS_Address(ins))) )
+                return true;
+    return false;
+}
+
+/* Count the instructions of the target routines, per BBL in -bbl mode. */
+/* A counted run of instructions stops at the end of the BBL, at the entry of a target routine */
+/* (routine_counter_mt has to switch the current routine first) and at REP-prefixed instructions, */
+/* which execute once per iteration and therefore keep their own counter. */
+/* The resulting counts are the same as counting every instruction. */
+/* With -flop_only and without BBL IDs, only the FLOP get a counter per instruction */
+/* and the other instructions of a run are added to index 0 by one call at its head. */
+/* With -hotspots, the FLOP instructions are also counted per instruction address, by the counter */
+/* of their run or by their own call where they are counted one by one. */
+/* The other code of the -img images is always counted per BBL, for the routine it belongs to; */
+/* a REP-prefixed instruction counts once per execution there. */
+/* Every trace starts as VERSION_OFF, which has no counters and only switches to VERSION_ON */
+/* while the thread counts (-control), after counting_resume; VERSION_ON switches back when it stops. */
+/* The traces without counted instructions are not instrumented at all: their version does not */
+/* matter, since every counted trace checks the counting state at its own head. */
+VOID Trace(TRACE trace, VOID *v) {
+    if( !TRACE_isCounted(trace) )
+        return;
+
+    INS first = BBL_InsHead(TRACE_BblHead(trace));
+    INS_InsertCall(first, IPOINT_BEFORE, (AFUNPTR)counting_sync, IARG_FAST_ANALYSIS_CALL,
+        IARG_REG_VALUE, RegThread, IARG_RETURN_REGS, RegCounting, IARG_END);
+    if( TRACE_Version(trace) == VERSION_OFF ) {
+        INS_InsertIfCall(first, IPOINT_BEFORE, (AFUNPTR)counting_sync, IARG_FAST_ANALYSIS_CALL,
+            IARG_REG_VALUE, RegThread, IARG_END);
+        INS_InsertThenCall(first, IPOINT_BEFORE, (AFUNPTR)counting_resume,
+            IARG_REG_VALUE, RegThread, IARG_RETURN_REGS, RegInsTable, IARG_END);
+        INS_InsertVersionCase(first, RegCounting, 1, VERSION_ON, IARG_END);
+        return;
+    }
+    INS_InsertVersionCase(first, RegCounting, 0, VERSION_OFF, IARG_END);
+
+    /* Fall back to the counter per instruction when the BBL IDs run out */
+    bool perins = !KnobBblCount || (BblNum + TRACE_NumIns(trace) > KnobBblMax);
+    std::map<UINT32, HIST_ENTRY> hist, imghist;
+    std::vector<UINT32> spots;
+    HIST_ENTRY others = { 0, 0, 0 };
+
+    for( BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl) ) {
+        INS head = INS_Invalid();
+        INS imghead = INS_Invalid();
+        RTN_COUNT *owner = 0;
+        INS samplehead = INS_Invalid();
+        UINT32 sampled = 0;
+        for( INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins) ) {
+            ADDRINT addr = INS_Address(ins);
+            RTN_COUNT *rc = RTN_findTargetRoutine(addr);
+            if( !rc || rc->_address == addr || INS_HasRealRep(ins) ) {
+                INS_insertBblCounter(head, hist, 0, &spots);
+                INS_insertOtherCounter(head, others);
+                head = INS_Invalid();
+            }
+
+            /* Code of a counted image outside the target routines */
+            RTN_COUNT *orc = 0;
+            if( !rc && ImgMode )
+                orc = (owner && addr - owner->_address < owner->_size) ? owner : IMG_findImageRoutine(addr);
+            if( orc != owner ) {
+                INS_insertBblCounter(imghead, imghist, owner);
+                imghead = INS_Invalid();
+                owner = orc;
+            }
+            if( orc ) {
+                xed_iform_enum_t iform = xed_decoded_inst_get_iform_enum(INS_XedDec(ins));
+                UINT32 index = IFORM_getIndex(iform);
+                if( KnobFlopOnly && !IfmClass._isFLOP[iform] )
+                    index = 0;
+                if( !INS_Valid(imghead) )
+                    imghead = ins;
+                /* The dynamic memory accesses count all elements here */
+                HIST_ENTRY &he = imghist[index];
+                he._count++;
+                INS_addMemoryBytes(ins, he);
+                continue;
+            }
+            if( !rc )
+                continue;
+            if( !INS_Valid(samplehead) )
+                samplehead = ins;
+            sampled++;
+
+            /* The iforms of the target routines were indexed in Image */
+            xed_iform_enum_t iform = xed_decoded_inst_get_iform_enum(INS_XedDec(ins));
+            UINT32 index = IformIndex[iform];
+            if( KnobFlopOnly && !IfmClass._isFLOP[iform] )
+                index = 0;
+            UINT32 spot = (SpotMode && (IfmClass._isFLOP[iform] || LoopHeaders.count(addr))) ? SPOT_getSlot(ins, rc, iform) : SPOT_NONE;
+            INS_insertMaskCounter(ins, iform, index);
+            if( INS_HasRealRep(ins) || INS_hasDynamicMemory(ins) ) {
+                INS_insertInsCounter(ins, index);
+                INS_insertSpotCounter(ins, spot);
+                continue;
+            }
+            if( !INS_Valid(head) )
+                head = ins;
+            if( !perins ) {
+                HIST_ENTRY &he = hist[index];
+                he._count++;
+                INS_addMemoryBytes(ins, he);
+                if( spot != SPOT_NONE )
+                    spots.push_back(spot);
+            }
+            else if( index == 0 ) {
+                others._count++;
+                INS_addMemoryBytes(ins, others);
+                INS_insertSpotCounter(ins, spot);
+            }
+            else {
+                INS_insertInsCounter(ins, index);
+                INS_insertSpotCounter(ins, spot);
+            }
+        }
+        INS_insertBblCounter(head, hist, 0, &spots);
+        INS_insertOtherCounter(head, others);
+        INS_insertBblCounter(imghead, imghist, owner);
+
+        /* Count down to the next sample (or -live publication) by the instructions of the target routines in this BBL */
+        if( (SampleMode || LiveMode) && sampled ) {
+            INS_InsertIfCall(samplehead, IPOINT_BEFORE, (AFUNPTR)sample_countdown, IARG_FAST_ANALYSIS_CALL,
+                IARG_REG_VALUE, RegThread, IARG_UINT32, sampled, IARG_END);
+            INS_InsertThenCall(samplehead, IPOINT_BEFORE, (AFUNPTR)sample_take,
+                IARG_REG_VALUE, RegThread, IARG_RETURN_REGS, RegInsTable, IARG_END);
+        }
+    }
+}
+
+VOID TraceTimed(TRACE trace, VOID *v) {
+    UINT64 start = TIME_ns();
+    Trace(trace, v);
+    InstrumentNs += TIME_ns() - start;
 }
 
 // Note that opening a file in a callback is only supported on Linux systems.
@@ -435,45 +2055,320 @@ VOID ThreadStart(THREADID threadid, CONTEXT *ctxt, INT32 flags, VOID *v) {
     numThreads++;
 
     PIN_GetLock(&pinLock, threadid+1); // for output
-    *out << "* Starting tid " << threadid << endl;
+    *info << "* Starting tid " << threadid << endl;
     PIN_ReleaseLock(&pinLock);
 
-    thread_data_t* tdata = new thread_data_t;
-    tdata->tid = threadid;
+    /* Reuse the Thread Data of an exited thread, its tables have been reset */
+    PIN_GetLock(&pinLock, threadid+1);
+    thread_data_t* tdata = TdPool;
+    if( tdata )
+        TdPool = tdata->_next;
+    PIN_ReleaseLock(&pinLock);
 
+    if( tdata == 0 ) {
+        tdata = new thread_data_t;
+        if( SampleMode )
+            tdata->Samples = new SAMPLE[KnobSampleBuf];
+        if( KnobBblCount || ImgMode || SpotMode )
+            tdata->BblCount = (UINT64 *)calloc(SpotBase + (SpotMode ? KnobHotspotMax : 0), sizeof(UINT64));
+        /* Every BBL ID is recorded at most once between two flushes */
+        if( KnobBblCount )
+            tdata->BblTouched = new UINT32[KnobBblMax];
+    }
+    tdata->tid = threadid;
+    /* ThreadStart runs in the new thread, ThreadFini not always in the exiting one */
+    tdata->OsTid = PIN_GetTid();
+    tdata->Name = TL_threadName(tdata->OsTid);
+    if( LiveMode )
+        TL_attachLive(tdata);
+    if( SampleMode || LiveMode )
+        tdata->SampleLeft = KnobSampleIcount ? (INT64)KnobSampleIcount.Value() : INT64_MAX;
+
+    /* The counting state is taken in the same section that links the thread into TdList, */
+    /* so a broadcast of ControlHandler either sees the thread or has set CountingAll before */
+    PIN_GetLock(&pinLock, threadid+1);
+    tdata->Counting = CountingAll;
     tdata->_next = TdList;
     TdList = tdata;
+    PIN_ReleaseLock(&pinLock);
 
     if (PIN_SetThreadData(tls_key, tdata, threadid) == FALSE) {
         cerr << "PIN_SetThreadData failed" << endl;
         PIN_ExitProcess(1);
     }
+
+    /* No target routine has been entered by this thread yet */
+    PIN_SetContextReg(ctxt, RegInsTable, 0);
+    PIN_SetContextReg(ctxt, RegBblCount, (ADDRINT)tdata->BblCount);
+    PIN_SetContextReg(ctxt, RegThread, (ADDRINT)tdata);
+    PIN_SetContextReg(ctxt, RegCounting, tdata->Counting);
+}
+
+/* Internal thread of -sample_ms or -live_ms: ask every thread for a sample at each tick. */
+/* A thread subtracting from SampleLeft at the same time may miss one tick. */
+VOID TimerThread(VOID *arg) {
+    while( !TimerExit && !PIN_IsProcessExiting() ) {
+        PIN_Sleep(TimerMs);
+        PIN_GetLock(&pinLock, PIN_ThreadId()+1);
+        for(thread_data_t *td = TdList; td; td = td->_next)
+            td->SampleLeft = 0;
+        PIN_ReleaseLock(&pinLock);
+    }
+    PIN_ExitThread(0);
+}
+
+/* Stop the timer thread before the application threads are gone. */
+VOID PrepareForFini(VOID *v) {
+    TimerExit = true;
+    PIN_WaitForThreadTermination(TimerUid, PIN_INFINITE_TIMEOUT, 0);
+}
+
+/* Start and stop counting on the events of the -control triggers. */
+/* The threads pick up the new state at the head of their next trace (counting_sync). */
+VOID ControlHandler(EVENT_TYPE ev, VOID *val, CONTEXT *ctxt, VOID *ip, THREADID threadid, BOOL bcast) {
+    UINT64 counting;
+    switch(ev) {
+        case EVENT_START:
+            counting = 1;
+            break;
+        case EVENT_STOP:
+            counting = 0;
+            break;
+        default:
+            return;
+    }
+
+    PIN_GetLock(&pinLock, threadid+1);
+    thread_data_t* tdata = get_tls(threadid);
+    if( bcast || tdata == 0 ) {
+        CountingAll = counting;
+        for(thread_data_t *td = TdList; td; td = td->_next)
+            td->Counting = counting;
+    }
+    else
+        tdata->Counting = counting;
+    *info << "* " << (counting ? "Start" : "Stop") << " counting, tid " << threadid << (bcast ? " (all threads)" : "") << endl;
+    PIN_ReleaseLock(&pinLock);
 }
 
 // This routine is executed every time a thread is destroyed.
 VOID ThreadFini(THREADID threadid, const CONTEXT *ctxt, INT32 code, VOID *v) {
     PIN_GetLock(&pinLock, threadid+1);
-    *out << "* Stopping tid " << threadid << ", code: " << code << endl;
+    *info << "* Stopping tid " << threadid << ", code: " << code << endl;
     PIN_ReleaseLock(&pinLock);
+    UINT64 start = TIME_ns();
 
     thread_data_t* tdata = get_tls(threadid);
-    TL_calculateStatistics(tdata->RtnList);
+    if( tdata->BblCount )
+        TL_flushBblCounts(tdata);
+
+    /* The last sample holds the totals of the thread */
+    if( SampleMode ) {
+        TL_takeSample(tdata);
+        TL_writeSamples(tdata);
+    }
+
+    TL_calculateStatistics(tdata->RtnList, true);
+    if( LiveMode )
+        TL_detachLive(tdata);
+
+    if( ImgMode ) {
+        PIN_GetLock(&pinLock, threadid+1);
+        TL_foldImgBblCounts(tdata);
+        PIN_ReleaseLock(&pinLock);
+    }
+
+    /* Hand the call counts of the thread to its routine counts */
+    if( !KnobPerCall )
+        for(UINT64 i=0; i<tdata->RtnSlot_len; i++)
+            if( tdata->RtnSlot[i] )
+                tdata->RtnSlot[i]->_rtnCount = tdata->RtnCalls[i];
+
+    TL_mergeCounts(tdata);
+    if( SpotMode )
+        TL_mergeSpots(tdata);
+
+    /* Keep the counts of the thread for the report or drop them, */
+    /* and hand its Thread Data to the next thread. The name may have changed since ThreadStart, */
+    /* its task is only gone if the thread has already exited. */
+    string name = TL_threadName(tdata->OsTid);
+    if( name.empty() )
+        name = tdata->Name;
+    PIN_SetThreadData(tls_key, 0, threadid);
+    PIN_GetLock(&pinLock, threadid+1);
+    TL_keepDetail(tdata, name);
+    TL_release(tdata);
+    PIN_ReleaseLock(&pinLock);
+    __sync_fetch_and_add(&ThreadFiniNs, TIME_ns() - start);
 }
 
-/*!
- * Print out analysis results.
- * This function is called when the application exits.
- * @param[in]   code            exit code of the application
- * @param[in]   v               value specified by the tool in the 
- *                              PIN_AddFiniFunction function call
- */
-VOID Fini(INT32 code, VOID *v) {
+/* FLOP of a hotspot, all lanes of a masked instruction, 0 for a loop header without FLOP */
+UINT64 SPOT_flop(const SPOT *sp) {
+    if( !IfmClass._isFLOP[sp->_iform] )
+        return 0;
+    return sp->_count * IfmClass._fmaWeight[sp->_iform] * IfmClass._elemno[sp->_iform];
+}
+
+bool SPOT_moreFlop(UINT32 a, UINT32 b) {
+    return SPOT_flop(&SpotTable[a]) > SPOT_flop(&SpotTable[b]);
+}
+
+/* The -hotspots slots with the most FLOP of every target routine, indexed by routine ID */
+std::vector<std::vector<UINT32> > SPOT_topByRoutine() {
+    std::vector<std::vector<UINT32> > top(RtnNum);
+    for(UINT32 s=0; s<SpotNum; s++)
+        if( SPOT_flop(&SpotTable[s]) )
+            top[SpotTable[s]._rtn->_id].push_back(s);
+    for(UINT32 r=0; r<RtnNum; r++) {
+        std::stable_sort(top[r].begin(), top[r].end(), SPOT_moreFlop);
+        if( top[r].size() > KnobHotspots )
+            top[r].resize(KnobHotspots);
+    }
+    return top;
+}
 
-    RL_calculateStatistics(RtnList, TdList);
+/* Calculate the iterations, FLOP and nesting depth of the loops from the hotspot counts (-loops). */
+/* A FLOP instruction counts for every loop of its routine whose body contains it. */
+void LOOP_calculateStatistics() {
+    std::vector<std::vector<UINT32> > byRoutine(RtnNum);
+    for(UINT32 l=0; l<LoopList.size(); l++)
+        byRoutine[LoopList[l]._rtn->_id].push_back(l);
+
+    for(UINT32 l=0; l<LoopList.size(); l++) {
+        LOOP &loop = LoopList[l];
+        if( loop._slot != SPOT_NONE )
+            loop._iterations = SpotTable[loop._slot]._count;
+        const std::vector<UINT32> &siblings = byRoutine[loop._rtn->_id];
+        for(UINT32 k=0; k<siblings.size(); k++) {
+            const LOOP &outer = LoopList[siblings[k]];
+            if( siblings[k] != l && outer._header <= loop._header && loop._end <= outer._end )
+                loop._depth++;
+        }
+    }
+
+    for(UINT32 s=0; s<SpotNum; s++) {
+        const SPOT *sp = &SpotTable[s];
+        UINT64 flop = SPOT_flop(sp);
+        if( flop == 0 )
+            continue;
+        const std::vector<UINT32> &loops = byRoutine[sp->_rtn->_id];
+        for(UINT32 k=0; k<loops.size(); k++) {
+            LOOP &loop = LoopList[loops[k]];
+            if( loop._header <= sp->_address && sp->_address <= loop._end ) {
+                loop._flopcount += flop;
+                loop._iformFlop[sp->_iform] += flop;
+            }
+        }
+    }
+}
+
+bool LOOP_lessThan(const LOOP &a, const LOOP &b) {
+    if( a._rtn != b._rtn )
+        return a._rtn->_id < b._rtn->_id;
+    return a._header < b._header;
+}
+
+/* Write the loop records and the FLOP per iform of every loop (-loops). */
+VOID WriteLoops(REPORT_WRITER *w) {
+    for(UINT32 l=0; l<LoopList.size(); l++) {
+        const LOOP &loop = LoopList[l];
+        REPORT_RECORD rec(RECORD_LOOP);
+        rec.Set(FIELD_ROUTINE, loop._rtn->_name.c_str());
+        rec.Set(FIELD_ADDRESS, loop._header);
+        rec.Set(FIELD_FILE, loop._file->c_str());
+        rec.Set(FIELD_LINE, loop._line);
+        rec.Set(FIELD_DEPTH, loop._depth);
+        rec.Set(FIELD_ITERATIONS, loop._iterations);
+        rec.Set(FIELD_FLOP, loop._flopcount);
+        w->Write(rec);
+        for(std::map<xed_iform_enum_t, UINT64>::const_iterator it = loop._iformFlop.begin(); it != loop._iformFlop.end(); ++it) {
+            REPORT_RECORD irec(RECORD_LOOP_IFORM);
+            irec.Set(FIELD_ROUTINE, loop._rtn->_name.c_str());
+            irec.Set(FIELD_ADDRESS, loop._header);
+            irec.Set(FIELD_IFORM, xed_iform_enum_t2str(it->first));
+            irec.Set(FIELD_FLOP, it->second);
+            w->Write(irec);
+        }
+    }
+}
+
+/* Write the hotspot records of a routine (-hotspots). */
+VOID WriteHotspots(REPORT_WRITER *w, const std::vector<UINT32> &spots) {
+    for(UINT32 k=0; k<spots.size(); k++) {
+        const SPOT *sp = &SpotTable[spots[k]];
+        REPORT_RECORD rec(RECORD_HOTSPOT);
+        rec.Set(FIELD_ROUTINE, sp->_rtn->_name.c_str());
+        rec.Set(FIELD_ADDRESS, sp->_address);
+        rec.Set(FIELD_IFORM, xed_iform_enum_t2str(sp->_iform));
+        rec.Set(FIELD_EXECOUNT, sp->_count);
+        rec.Set(FIELD_FLOP, SPOT_flop(sp));
+        rec.Set(FIELD_FILE, sp->_file->c_str());
+        rec.Set(FIELD_LINE, sp->_line);
+        w->Write(rec);
+    }
+}
+
+/* Write the record of a routine and of its FLOP iforms with non-zero execution counts. */
+/* The counts of a routine in a thread (tc) have neither address nor image. */
+VOID WriteRoutine(REPORT_WRITER *w, RTN_COUNT *rc, THREAD_COUNT *tc) {
+    if( rc->_icount == 0 )
+        return;
+    REPORT_RECORD rec(RECORD_ROUTINE);
+    if( tc ) {
+        rec.Set(FIELD_TID, tc->_tid);
+        rec.Set(FIELD_THREAD, tc->_name.c_str());
+    }
+    rec.Set(FIELD_IMAGE, rc->_image.c_str());
+    rec.Set(FIELD_ROUTINE, rc->_name.c_str());
+    rec.Set(FIELD_CALLS, rc->_rtnCount);
+    rec.Set(FIELD_ICOUNT, rc->_icount);
+    rec.Set(FIELD_FLOP, rc->_flopcount);
+    rec.Set(FIELD_RBYTES, rc->_rbytes);
+    rec.Set(FIELD_WBYTES, rc->_wbytes);
+    if( !tc )
+        rec.Set(FIELD_ADDRESS, rc->_address);
+    w->Write(rec);
+
+    for(UINT64 i=1; i<rc->_inslen; i++) {
+        xed_iform_enum_t iform = IformOf[i];
+        INS_COUNT *ic = &rc->_instable[i];
+        if( !IfmClass._isFLOP[iform] || ic->_execount == 0 )
+            continue;
+        REPORT_RECORD irec(RECORD_IFORM);
+        if( tc )
+            irec.Set(FIELD_TID, tc->_tid);
+        irec.Set(FIELD_ROUTINE, rc->_name.c_str());
+        irec.Set(FIELD_IFORM, xed_iform_enum_t2str(iform));
+        irec.Set(FIELD_CATEGORY, xed_category_enum_t2str(xed_iform_to_category(iform)));
+        irec.Set(FIELD_EXTENSION, xed_extension_enum_t2str(xed_iform_to_extension(iform)));
+        irec.Set(FIELD_PRECISION, PrecName[IfmClass._prec[iform]]);
+        irec.Set(FIELD_EXECOUNT, ic->_execount);
+        irec.Set(FIELD_CMPCOUNT, ic->_cmpcount);
+        irec.Set(FIELD_MASKCOUNT, ic->_maskcount);
+        irec.Set(FIELD_RBYTES, ic->_rbytes);
+        irec.Set(FIELD_WBYTES, ic->_wbytes);
+        irec.Set(FIELD_ELEMENTS, IfmClass._elemno[iform]);
+        irec.Set(FIELD_FMA, IfmClass._fmaWeight[iform] == 2);
+        irec.Set(FIELD_SCALAR, IfmClass._isScalarSimd[iform]);
+        irec.Set(FIELD_MASKOP, IfmClass._isMaskOP[iform]);
+        w->Write(irec);
+    }
+}
+
+/* Print the analysis results as setw tables (-format text). */
+VOID TextReport() {
+    for(UINT32 i=1; i<IformNum; i++)
+        IformSorted.push_back(i);
+    std::sort(IformSorted.begin(), IformSorted.end(), IFORM_lessThan);
+    std::vector<std::vector<UINT32> > hotspots;
+    if( KnobHotspots )
+        hotspots = SPOT_topByRoutine();
     
     *out <<  "===============================================" << endl;
     *out <<  "           The Total Analysis Result           " << endl;
     *out <<  "===============================================" << endl;
+    if( SpotLost )
+        *out << "Warning: " << SpotLost << " FLOP instructions have no hotspot counter, increase -hotspot_max" << endl;
  
     for(RTN_COUNT * rc = RtnList; rc; rc = rc->_next) {
 
@@ -486,7 +2381,10 @@ VOID Fini(INT32 code, VOID *v) {
                 << "Address:             " << "0x" << hex << rc->_address << dec  << endl
                 << "Calls:               " << setw(10) << rc->_rtnCount  << endl
                 << "Instructions counts: " << setw(10) << rc->_icount  << endl
-                << "FLOP counts (TODO):  " << setw(10) << rc->_flopcount << endl;
+                << "FLOP counts (TODO):  " << setw(10) << rc->_flopcount << endl
+                << "Memory read bytes:   " << setw(10) << rc->_rbytes << endl
+                << "Memory write bytes:  " << setw(10) << rc->_wbytes << endl;
+            RC_printRoofline("", rc->_flopcount, rc->_rbytes + rc->_wbytes);
 
             *out << "FLOP instructions: " << endl
                  << "    " << std::setiosflags(ios::left) 
@@ -501,6 +2399,7 @@ VOID Fini(INT32 code, VOID *v) {
                  << setw(8) << "*[FMA]"
                  << setw(7) << "*[SS]"
                  << setw(10) << "[MaskOP]"
+                 << setw(10) << "[prec]"
                  << setw(8) << "[#opd]"
                  << setw(15) << "*[opd1]"
                  << setw(15) << "[opd2]"
@@ -509,32 +2408,30 @@ VOID Fini(INT32 code, VOID *v) {
                  << setw(15) << "[opd5]"
                  << endl; 
 
-            for(int i=0; i<XED_IFORM_LAST; i++) {
-                if( insAttr[i]._isFLOP && rc->_instable[i]._execount ) {
+            for(UINT64 k=0; k<IformSorted.size(); k++) {
+                UINT32 i = IformSorted[k];
+                xed_iform_enum_t iform = IformOf[i];
+                if( i < rc->_inslen && IfmClass._isFLOP[iform] && rc->_instable[i]._execount ) {
+                    const xed_inst_t *xedi = IfmClass._inst[iform];
                     *out << "    " << std::setiosflags(ios::left) 
-                         << setw(27) << xed_iform_enum_t2str(static_cast<xed_iform_enum_t>(i)) 
+                         << setw(27) << xed_iform_enum_t2str(iform) 
                          << std::resetiosflags(ios::left) 
                         //  << setw(12) << xed_iclass_enum_t2str(rc->_instable[i]._iclass)
-                         << setw(12) << xed_category_enum_t2str(insAttr[i]._cat) 
-                         << setw(11) << xed_extension_enum_t2str(insAttr[i]._ext)
+                         << setw(12) << xed_category_enum_t2str(xed_iform_to_category(iform)) 
+                         << setw(11) << xed_extension_enum_t2str(xed_iform_to_extension(iform))
                          << setw(12) << rc->_instable[i]._execount 
                          << setw(12) << rc->_instable[i]._cmpcount 
                          << setw(10) << rc->_instable[i]._maskcount
-                         << setw(8) << insAttr[i]._isFMA 
-                         << setw(7) << insAttr[i]._isScalarSimd 
-                         << setw(10) << insAttr[i]._isMaskOP
-                         << setw(8) << insAttr[i]._opdno;
-                    for(int j=0; j<(int)xed_decoded_inst_noperands(insAttr[i]._xedd); j++) {
-                        *out << setw(15) 
-                        << decstr(xed_decoded_inst_operand_element_size_bits(insAttr[i]._xedd, j)) 
-                        + "/" 
-                        + xed_operand_element_type_enum_t2str(xed_decoded_inst_operand_element_type(insAttr[i]._xedd, j)) 
-                        + "/" 
-                        + decstr(xed_decoded_inst_operand_elements(insAttr[i]._xedd, j));
-                    }
+                         << setw(8) << (IfmClass._fmaWeight[iform] == 2)
+                         << setw(7) << (UINT32)IfmClass._isScalarSimd[iform] 
+                         << setw(10) << (UINT32)IfmClass._isMaskOP[iform]
+                         << setw(10) << PrecName[IfmClass._prec[iform]]
+                         << setw(8) << xed_inst_noperands(xedi);
+                    for(UINT32 j=0; j<xed_inst_noperands(xedi); j++)
+                        *out << setw(15) << OPD_str(xed_inst_operand(xedi, j));
                     *out << endl; 
                     *out << "    |-> "; 
-                    XEDD_printAttribute(insAttr[i]._xedd);
+                    XEDI_printAttribute(xedi);
 
                     *out << endl; 
 
@@ -567,25 +2464,149 @@ VOID Fini(INT32 code, VOID *v) {
             *out << "    * [m_cnt]: Masking Bits Count. " << endl;
             *out << "    * [FMA]:   Fused Multiply-Add. " << endl;
             *out << "    * [SS]:    Scalar SIMD. " << endl;
-            *out << "    * [opd]:   Shows bits, type and number of elements (#element). " << endl;
+            *out << "    * [opd]:   Shows bits, element type and, for FP, number of elements. " << endl;
+
+            if( KnobHotspots ) {
+                const std::vector<UINT32> &spots = hotspots[rc->_id];
+                *out << "Hotspots (the " << spots.size() << " FLOP instructions with the most FLOP): " << endl
+                     << "    " << std::setiosflags(ios::left)
+                     << setw(20) << "[address]"
+                     << std::resetiosflags(ios::left)
+                     << setw(14) << "[f_cnt]"
+                     << setw(14) << "[e_cnt]"
+                     << "  " << std::setiosflags(ios::left)
+                     << setw(40) << "[XED_IFORM]"
+                     << "[source]"
+                     << std::resetiosflags(ios::left)
+                     << endl;
+                for(UINT32 k=0; k<spots.size(); k++) {
+                    const SPOT *sp = &SpotTable[spots[k]];
+                    *out << "    " << std::setiosflags(ios::left)
+                         << setw(20) << hexstr(sp->_address)
+                         << std::resetiosflags(ios::left)
+                         << setw(14) << SPOT_flop(sp)
+                         << setw(14) << sp->_count
+                         << "  " << std::setiosflags(ios::left)
+                         << setw(40) << xed_iform_enum_t2str(sp->_iform)
+                         << (sp->_file->empty() ? "?" : *sp->_file) << ":" << sp->_line
+                         << std::resetiosflags(ios::left)
+                         << endl;
+                }
+                *out << "    * [f_cnt] counts all lanes of masked instructions. " << endl;
+            }
             *out << endl;
         }
     }
  
+    if( KnobLoops ) {
+        *out <<  "===============================================" << endl;
+        *out <<  "         The Per-Loop Analysis Result          " << endl;
+        *out <<  "===============================================" << endl;
+
+        *out << "    " << std::setiosflags(ios::left)
+             << setw(32) << "[Routine]"
+             << setw(20) << "[header]"
+             << std::resetiosflags(ios::left)
+             << setw(8) << "[depth]"
+             << setw(14) << "[iter]"
+             << setw(14) << "[f_cnt]"
+             << setw(12) << "[f/iter]"
+             << "  " << "[source]"
+             << endl;
+        for(UINT32 l=0; l<LoopList.size(); l++) {
+            const LOOP &loop = LoopList[l];
+            *out << "    " << std::setiosflags(ios::left)
+                 << setw(32) << loop._rtn->_name
+                 << setw(20) << hexstr(loop._header)
+                 << std::resetiosflags(ios::left)
+                 << setw(8) << loop._depth
+                 << setw(14) << loop._iterations
+                 << setw(14) << loop._flopcount
+                 << setw(12) << (loop._iterations ? (double)loop._flopcount / loop._iterations : 0.0)
+                 << "  " << (loop._file->empty() ? "?" : *loop._file) << ":" << loop._line
+                 << endl;
+            for(std::map<xed_iform_enum_t, UINT64>::const_iterator it = loop._iformFlop.begin(); it != loop._iformFlop.end(); ++it)
+                *out << "        |-> " << std::setiosflags(ios::left)
+                     << setw(40) << xed_iform_enum_t2str(it->first)
+                     << std::resetiosflags(ios::left)
+                     << setw(14) << it->second
+                     << endl;
+        }
+        *out << "    * [iter]:  Executions of the loop header. " << endl;
+        *out << "    * [f_cnt]: FLOP of the loop body, inner loops included, per iform below. " << endl;
+        *out << endl;
+    }
+
+    if( ImgList ) {
+        *out <<  "===============================================" << endl;
+        *out <<  "         The Per-Image Analysis Result         " << endl;
+        *out <<  "===============================================" << endl;
+
+        if( ImgBblLost )
+            *out << "Warning: " << ImgBblLost << " image BBLs were not counted, increase -img_bbl_max" << endl;
+
+        for(IMG_COUNT *ic = ImgList; ic; ic = ic->_next) {
+            *out << "Image:               " << ic->_name << endl
+                 << "Instructions counts: " << setw(10) << ic->_icount << endl
+                 << "FLOP counts:         " << setw(10) << ic->_flopcount << endl
+                 << "Memory read bytes:   " << setw(10) << ic->_rbytes << endl
+                 << "Memory write bytes:  " << setw(10) << ic->_wbytes << endl;
+            RC_printRoofline("", ic->_flopcount, ic->_rbytes + ic->_wbytes);
+
+            /* Routines by FLOP counts, the target routines included */
+            std::vector<RTN_COUNT *> rtns;
+            for(RTN_COUNT *rc = ic->_rtnList; rc; rc = rc->_next)
+                if( rc->_icount )
+                    rtns.push_back(rc);
+            for(RTN_COUNT *rc = RtnList; rc; rc = rc->_next)
+                if( rc->_icount && rc->_image == ic->_name )
+                    rtns.push_back(rc);
+            std::stable_sort(rtns.begin(), rtns.end(), RC_moreFlop);
+
+            *out << "    " << std::setiosflags(ios::left)
+                 << setw(40) << "[Routine]"
+                 << std::resetiosflags(ios::left)
+                 << setw(14) << "[i_cnt]"
+                 << setw(14) << "[f_cnt]"
+                 << setw(14) << "[bytes]"
+                 << setw(12) << "[FLOP/B]"
+                 << endl;
+            for(UINT64 k=0; k<rtns.size(); k++) {
+                *out << "    " << std::setiosflags(ios::left)
+                     << setw(40) << rtns[k]->_name
+                     << std::resetiosflags(ios::left)
+                     << setw(14) << rtns[k]->_icount
+                     << setw(14) << rtns[k]->_flopcount
+                     << setw(14) << rtns[k]->_rbytes + rtns[k]->_wbytes
+                     << setw(12) << (rtns[k]->_rbytes + rtns[k]->_wbytes ? (double)rtns[k]->_flopcount / (rtns[k]->_rbytes + rtns[k]->_wbytes) : 0.0)
+                     << endl;
+            }
+            *out << endl;
+        }
+    }
+
     *out <<  "===============================================" << endl;
     *out <<  "      The Multi-Threading Analysis Result      " << endl;
     *out <<  "===============================================" << endl;
 
-    for(thread_data_t *td = TdList; td; td = td->_next) {
-        *out << "Thread ID: " << td->tid << endl;
-        *out << "Routine counts: " << td->RtnList_len << endl;
-        for (RTN_COUNT * rc = td->RtnList; rc; rc = rc->_next) {
+    *out << "Threads: " << numThreads << ", reported below: the " << ThdTop << " with the most FLOP (-thread_top)";
+    if( KnobThreadName.NumberOfValues() > 1 || !KnobThreadName.Value().empty() )
+        *out << " and the ones named by -thread_name";
+    *out << endl << endl;
+
+    for(THREAD_COUNT *tc = ThdList; tc; tc = tc->_next) {
+        *out << "Thread ID: " << tc->_tid << endl;
+        *out << "Thread name: " << tc->_name << endl;
+        *out << "Routine counts: " << tc->_rtnLen << endl;
+        for (RTN_COUNT * rc = tc->_rtnList; rc; rc = rc->_next) {
 
             /* Basic Info */
             *out << "    Routine (Procedure): " << rc->_name  << endl
                  << "    Image:               " << rc->_image  << endl
                  << "    Instructions counts: " << setw(10) << rc->_icount  << endl
-                 << "    FLOP counts (TODO):  " << setw(10) << rc->_flopcount 
+                 << "    FLOP counts (TODO):  " << setw(10) << rc->_flopcount << endl
+                 << "    Memory read bytes:   " << setw(10) << rc->_rbytes << endl
+                 << "    Memory write bytes:  " << setw(10) << rc->_wbytes
                  << endl;
 
             *out << "    FLOP instructions: " << endl
@@ -601,12 +2622,14 @@ VOID Fini(INT32 code, VOID *v) {
                  << setw(7) << "[FMA]"
                  << setw(6) << "[SS]"
                  << setw(10) << "[MaskOP]"
-                 << setw(17) << "[#element_opd1]" 
+                 << setw(17) << "[#element]" 
                  << endl;
-            for(int i=0; i<XED_IFORM_LAST; i++) {
-                if( insAttr[i]._isFLOP && rc->_instable[i]._execount ) {
+            for(UINT64 k=0; k<IformSorted.size(); k++) {
+                UINT32 i = IformSorted[k];
+                xed_iform_enum_t iform = IformOf[i];
+                if( i < rc->_inslen && IfmClass._isFLOP[iform] && rc->_instable[i]._execount ) {
                     *out << "        " << std::setiosflags(ios::left) 
-                         << setw(27) << xed_iform_enum_t2str(static_cast<xed_iform_enum_t>(i)) 
+                         << setw(27) << xed_iform_enum_t2str(iform) 
                          << std::resetiosflags(ios::left) 
                         //  << setw(12) << xed_iclass_enum_t2str(rc->_instable[i]._iclass)
                         //  << setw(12) << xed_category_enum_t2str(rc->_instable[i]._cat) 
@@ -614,10 +2637,10 @@ VOID Fini(INT32 code, VOID *v) {
                          << setw(12) << rc->_instable[i]._execount 
                          << setw(12) << rc->_instable[i]._cmpcount 
                          << setw(9) << rc->_instable[i]._maskcount
-                         << setw(7) << insAttr[i]._isFMA 
-                         << setw(6) << insAttr[i]._isScalarSimd 
-                         << setw(10) << insAttr[i]._isMaskOP 
-                         << setw(17) << insAttr[i]._elemno;
+                         << setw(7) << (IfmClass._fmaWeight[iform] == 2)
+                         << setw(6) << (UINT32)IfmClass._isScalarSimd[iform] 
+                         << setw(10) << (UINT32)IfmClass._isMaskOP[iform] 
+                         << setw(17) << IfmClass._elemno[iform];
                         //  << " Test xedd: " << xed_iform_enum_t2str(xed_decoded_inst_get_iform_enum(rc->_instable[i]._xedd))
 
                     /* Mask Testing */
@@ -649,34 +2672,129 @@ VOID Fini(INT32 code, VOID *v) {
         }
         *out << endl;
     }
+}
 
-    /* Deallocate the dynamic memory allocation: RtnList */
-    for (RTN_COUNT *rc = RtnList; rc;) {
-        RTN_COUNT *cur = rc;
-        delete [] rc->_instable;
-        rc = rc->_next;
-        delete cur;
+/* Write one record per routine, FLOP iform and image with non-zero counts (-format json|csv|bin). */
+VOID WriteReport(REPORT_WRITER *w) {
+    w->Begin();
+
+    /* Routines in total, then per reported thread (tid) */
+    for(RTN_COUNT *rc = RtnList; rc; rc = rc->_next)
+        WriteRoutine(w, rc, 0);
+    if( KnobHotspots ) {
+        std::vector<std::vector<UINT32> > hotspots = SPOT_topByRoutine();
+        for(UINT32 r=0; r<RtnNum; r++)
+            WriteHotspots(w, hotspots[r]);
     }
- 
-    /* Deallocate the dynamic memory allocation: TdList */
-    for(thread_data_t *td = TdList; td;) {
-        thread_data_t *td_cur = td;
-        for (RTN_COUNT * rc = td->RtnList; rc;) {
-            RTN_COUNT * rc_cur = rc;
-            delete [] rc->_instable;
-            rc = rc->_next;
-            delete rc_cur;
+    if( KnobLoops )
+        WriteLoops(w);
+    for(THREAD_COUNT *tc = ThdList; tc; tc = tc->_next)
+        for(RTN_COUNT *rc = tc->_rtnList; rc; rc = rc->_next)
+            WriteRoutine(w, rc, tc);
+
+    for(IMG_COUNT *ic = ImgList; ic; ic = ic->_next) {
+        REPORT_RECORD rec(RECORD_IMAGE);
+        rec.Set(FIELD_IMAGE, ic->_name.c_str());
+        rec.Set(FIELD_ICOUNT, ic->_icount);
+        rec.Set(FIELD_FLOP, ic->_flopcount);
+        rec.Set(FIELD_RBYTES, ic->_rbytes);
+        rec.Set(FIELD_WBYTES, ic->_wbytes);
+        w->Write(rec);
+        for(RTN_COUNT *rc = ic->_rtnList; rc; rc = rc->_next) {
+            if( rc->_icount == 0 )
+                continue;
+            REPORT_RECORD rrec(RECORD_IMAGE_ROUTINE);
+            rrec.Set(FIELD_IMAGE, ic->_name.c_str());
+            rrec.Set(FIELD_ROUTINE, rc->_name.c_str());
+            rrec.Set(FIELD_ADDRESS, rc->_address);
+            rrec.Set(FIELD_ICOUNT, rc->_icount);
+            rrec.Set(FIELD_FLOP, rc->_flopcount);
+            rrec.Set(FIELD_RBYTES, rc->_rbytes);
+            rrec.Set(FIELD_WBYTES, rc->_wbytes);
+            w->Write(rrec);
         }
-        td = td->_next;
-        delete td_cur;
     }
 
-    /* Deallocate the dynamic memory allocation: insAttr */
-    for(int i=0; i<XED_IFORM_LAST; i++) {
-        if( insAttr[i]._xedd != NULL ) {
-            delete insAttr[i]._xedd;
-        }
+    w->End();
+}
+
+/*!
+ * Print out analysis results.
+ * This function is called when the application exits.
+ * @param[in]   code            exit code of the application
+ * @param[in]   v               value specified by the tool in the 
+ *                              PIN_AddFiniFunction function call
+ */
+VOID Fini(INT32 code, VOID *v) {
+    UINT64 start = TIME_ns();
+
+    /* Name the routine IDs of the samples */
+    if( SampleOut ) {
+        SampleOut->close();
+        std::ofstream names((KnobSampleFile.Value() + ".rtn").c_str());
+        for(RTN_COUNT *rc = RtnList; rc; rc = rc->_next)
+            names << rc->_id << " " << rc->_name << " " << rc->_image << endl;
+        delete SampleOut;
+        SampleOut = 0;
+    }
+
+    if( ImgList )
+        IL_calculateStatistics(ImgList, RtnList);
+
+    if( KnobLoops ) {
+        LOOP_calculateStatistics();
+        std::stable_sort(LoopList.begin(), LoopList.end(), LOOP_lessThan);
+    }
+
+    if( Writer ) {
+        WriteReport(Writer);
+        delete Writer;
+    }
+    else
+        TextReport();
+
+    /* Deallocate the dynamic memory allocation: RtnList */
+    RC_deleteList(RtnList);
+ 
+    /* Deallocate the dynamic memory allocation: TdList, TdPool and ThdList */
+    TL_deleteList(TdList);
+    TL_deleteList(TdPool);
+    for(THREAD_COUNT *tc = ThdList; tc;) {
+        THREAD_COUNT *tc_cur = tc;
+        RC_deleteList(tc->_rtnList);
+        tc = tc->_next;
+        delete tc_cur;
+    }
+
+    /* Deallocate the dynamic memory allocation: BblTable */
+    for(UINT32 b=0; b<BblNum; b++) {
+        delete [] BblTable[b]->_index;
+        delete [] BblTable[b]->_entry;
+        delete [] BblTable[b]->_spot;
+        delete BblTable[b];
     }
+    delete [] BblTable;
+    delete [] SpotTable;
+
+    /* Deallocate the dynamic memory allocation: ImgList and ImgBblTable */
+    for(IMG_COUNT *ic = ImgList; ic;) {
+        IMG_COUNT *ic_cur = ic;
+        RC_deleteList(ic->_rtnList);
+        ic = ic->_next;
+        delete ic_cur;
+    }
+    for(UINT32 b=0; b<ImgBblNum; b++) {
+        delete [] ImgBblTable[b]->_index;
+        delete [] ImgBblTable[b]->_entry;
+        delete ImgBblTable[b];
+    }
+    delete [] ImgBblTable;
+
+    RTN_freeTargets();
+
+    *info << "* Instrumentation took " << InstrumentNs / 1000000 << " ms" << endl;
+    *info << "* ThreadFini took " << ThreadFiniNs / 1000000 << " ms" << endl;
+    *info << "* Fini took " << (TIME_ns() - start) / 1000000 << " ms" << endl;
 
     /* IFORM Testing */
     // string fma_iform_str[] = {"PFMAX_MMXq_MEMq",
@@ -717,10 +2835,18 @@ VOID Fini(INT32 code, VOID *v) {
  */
 int main(int argc, char *argv[]) {
 
-    target_image = StripPath(argv[argc-1]);
+    /* The application is the first argument after "--", its own arguments follow */
+    target_image = "";
+    for(int i=1; i+1<argc; i++)
+        if( strcmp(argv[i], "--") == 0 ) {
+            target_image = StripPath(argv[i+1]);
+            break;
+        }
 
     // Initialize the pin lock
     PIN_InitLock(&pinLock);
+    for(int i=0; i<MERGE_SHARDS; i++)
+        PIN_InitLock(&mergeLock[i]);
 
     // Initialize symbol table code, needed for rtn instrumentation
     PIN_InitSymbols();
@@ -733,7 +2859,29 @@ int main(int argc, char *argv[]) {
     string fileName = KnobOutputFile.Value();
 
     if( !fileName.empty() ) 
-        out = new std::ofstream(fileName.c_str());
+        out = new std::ofstream(fileName.c_str(), ios::binary);
+
+    if( KnobFormat.Value() != "text" ) {
+        Writer = REPORT_newWriter(KnobFormat.Value(), out);
+        if( !Writer ) {
+            cerr << "Unknown -format " << KnobFormat.Value() << endl;
+            return Usage();
+        }
+        /* The progress messages go to stderr, which must not mix with the report */
+        if( fileName.empty() ) {
+            cerr << "-format " << KnobFormat.Value() << " needs an output file (-o)" << endl;
+            return Usage();
+        }
+    }
+    else
+        info = out;
+
+    // Compile the target routines
+    if( !RTN_initTargets() )
+        return Usage();
+
+    // Classify all iforms before the first image is instrumented
+    IFORM_initClass();
 
     // Obtain  a key for TLS storage.
     tls_key = PIN_CreateThreadDataKey(NULL);
@@ -743,15 +2891,80 @@ int main(int argc, char *argv[]) {
         PIN_ExitProcess(1);
     }
 
+    // Claim the scratch registers for the counters of the current thread
+    RegInsTable = PIN_ClaimToolRegister();
+    RegBblCount = PIN_ClaimToolRegister();
+    RegThread = PIN_ClaimToolRegister();
+    RegCounting = PIN_ClaimToolRegister();
+    if (!REG_valid(RegInsTable) || !REG_valid(RegBblCount) || !REG_valid(RegThread) || !REG_valid(RegCounting))
+    {
+        cerr << "Cannot allocate a scratch register." << endl;
+        PIN_ExitProcess(1);
+    }
+
     // Register Analysis routines to be called when a thread begins/ends
     PIN_AddThreadStartFunction(ThreadStart, 0);
     PIN_AddThreadFiniFunction(ThreadFini, 0);
 
     // Register Image to be called to instrument functions.
-    IMG_AddInstrumentFunction(Image, 0);
+    IMG_AddInstrumentFunction(ImageTimed, 0);
+    IMG_AddUnloadFunction(ImageUnload, 0);
+
+    // Register Trace to count the instructions
+    for(UINT32 i=0; i<KnobImages.NumberOfValues(); i++)
+        if( !KnobImages.Value(i).empty() )
+            ImgMode = true;
+    if( KnobBblCount )
+        BblTable = new BBL_HIST *[KnobBblMax];
+    if( ImgMode )
+        ImgBblTable = new BBL_HIST *[KnobImgBblMax];
+    SpotBase = KnobBblMax + (ImgMode ? KnobImgBblMax : 0);
+    SpotMode = KnobHotspots || KnobLoops;
+    if( SpotMode ) {
+        SpotTable = new SPOT[KnobHotspotMax];
+        PIN_InitLock(&spotLock);
+    }
+    TRACE_AddInstrumentFunction(TraceTimed, 0);
 
     // Register function to be called when the application exits
     PIN_AddFiniFunction(Fini, 0);
+
+    // Sample the routine counts per thread
+    SampleMode = KnobSampleIcount || KnobSampleMs;
+    if( SampleMode ) {
+        PIN_InitLock(&sampleLock);
+        SampleStart = TIME_ns();
+        SampleOut = new std::ofstream(KnobSampleFile.Value().c_str(), ios::binary);
+        if( !*SampleOut ) {
+            cerr << "Cannot open the sample file " << KnobSampleFile.Value() << endl;
+            return Usage();
+        }
+        /* Header: magic, version, size of a SAMPLE */
+        UINT32 header[2] = { 1, sizeof(SAMPLE) };
+        SampleOut->write("FLOPSMP", 8);
+        SampleOut->write((const char *)header, sizeof(header));
+    }
+    // Publish the counts per thread and routine to the -live file
+    LiveMode = !KnobLiveFile.Value().empty();
+    if( LiveMode ) {
+        PIN_InitLock(&liveLock);
+        if( !LIVE_open() ) {
+            cerr << "Cannot create the live file " << KnobLiveFile.Value() << endl;
+            return Usage();
+        }
+    }
+    TimerMs = KnobSampleMs ? KnobSampleMs.Value() : (LiveMode ? KnobLiveMs.Value() : 0);
+    if( TimerMs ) {
+        if( PIN_SpawnInternalThread(TimerThread, 0, 0, &TimerUid) == INVALID_THREADID ) {
+            cerr << "Cannot start the sampling timer thread" << endl;
+            PIN_ExitProcess(1);
+        }
+        PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
+    }
+
+    // Count between the -control start and stop events, from the start to the end without -control
+    control.RegisterHandler(ControlHandler, 0, FALSE);
+    control.Activate();
     
     cerr <<  "===============================================" << endl;
     cerr <<  "This application is instrumented by MyPinTool" << endl;
@@ -0,0 +1,243 @@
+/*
+$ make
+$ ./obj-intel64/flop_kernels.exe [iterations]
+$ pin -t ./obj-intel64/flop_counter.so -rtn 'kernel_*' -- ./obj-intel64/flop_kernels.exe
+*/
+
+#include <iostream>
+#include <cstdlib>
+#include <cpuid.h>
+#include <sys/time.h>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////
+// DEFINES
+////////////////////////////////////////////////////////////////////////////
+
+/* Run an instruction sequence n times, n > 0, with the loop control in general purpose registers */
+#define ASM_LOOP(n, body, ...) \
+    asm volatile("1:\n\t" body "dec %0\n\tjnz 1b\n\t" : "+r"(n) : : "cc", __VA_ARGS__)
+
+////////////////////////////////////////////////////////////////////////////
+// TYPES
+////////////////////////////////////////////////////////////////////////////
+
+/* A kernel routine and its known answer: the FLOP of one iteration as counted by flop_counter, */
+/* element operations of the FP instructions, x2 for FMA, only the active lanes of a masked one */
+typedef struct kernel {
+    const char *name;
+    const char *isa;
+    long flop;
+    bool (*supported)();
+    void (*run)(long);
+} KERNEL;
+
+////////////////////////////////////////////////////////////////////////////
+// PROTOTYPES
+////////////////////////////////////////////////////////////////////////////
+
+int main(int, char *[]);
+bool has_sse2();
+bool has_avx2();
+bool has_fma();
+bool has_avx512();
+bool has_avx512fp16();
+extern "C" {
+void kernel_sse_scalar(long);
+void kernel_sse_packed(long);
+void kernel_avx2(long);
+void kernel_fma3(long);
+void kernel_avx512(long);
+void kernel_avx512_masked(long);
+void kernel_avx512_cmpmask(long);
+void kernel_avx512_nonflop(long);
+void kernel_x87(long);
+void kernel_fp16(long);
+void x87_push();
+void x87_pop();
+}
+void run_x87(long);
+double wtime();
+
+////////////////////////////////////////////////////////////////////////////
+// GLOBALS
+////////////////////////////////////////////////////////////////////////////
+
+/* The registers are zeroed with integer XORs, which are not FLOP */
+KERNEL kernels[] = {
+    /* MULSD + ADDSD */
+    { "kernel_sse_scalar",    "sse",         1 + 1,         has_sse2,        kernel_sse_scalar },
+    /* MULPD xmm + ADDPS xmm */
+    { "kernel_sse_packed",    "sse",         2 + 4,         has_sse2,        kernel_sse_packed },
+    /* VMULPD ymm + VADDPS ymm */
+    { "kernel_avx2",          "avx2",        4 + 8,         has_avx2,        kernel_avx2 },
+    /* VFMADD231PD ymm + VFMADD231SD xmm */
+    { "kernel_fma3",          "fma3",        2 * 4 + 2 * 1, has_fma,         kernel_fma3 },
+    /* VFMADD231PS zmm + VMULPD zmm, no mask (k0) */
+    { "kernel_avx512",        "avx512",      2 * 16 + 8,    has_avx512,      kernel_avx512 },
+    /* VFMADD231PD zmm{k1} with 4 of 8 lanes + VADDPS zmm{k2} with 8 of 16 lanes */
+    { "kernel_avx512_masked", "avx512_mask", 2 * 4 + 8,     has_avx512,      kernel_avx512_masked },
+    /* VCMPPD k1{k2} zmm with 2 of 8 lanes: the write mask is k2, not the destination k1 */
+    { "kernel_avx512_cmpmask", "avx512_cmp", 2,             has_avx512,      kernel_avx512_cmpmask },
+    /* VMOVAPD + VPERMPD + VBLENDMPD{k1} + VCVTTPD2DQ zmm: FP moves, permutes, blends and conversions are no FLOP */
+    { "kernel_avx512_nonflop", "avx512_move", 0,            has_avx512,      kernel_avx512_nonflop },
+    /* FMUL + FADD on the x87 stack */
+    { "kernel_x87",           "x87",         1 + 1,         has_sse2,        run_x87 },
+    /* VADDPH zmm + VFMADD231PH zmm */
+    { "kernel_fp16",          "fp16",        32 + 2 * 32,   has_avx512fp16,  kernel_fp16 },
+};
+
+////////////////////////////////////////////////////////////////////////////
+// INPLEMENTATIONS
+////////////////////////////////////////////////////////////////////////////
+
+/* Run every kernel the CPU supports once with n iterations and print its known answer: */
+/*   <routine> <ISA class> <FLOP> <ms>, or "skip <routine> <ISA class>" */
+/* The FLOP are exact for the kernel routines (-rtn 'kernel_*'), main is not a kernel. */
+int main(int argc, char *argv[]) {
+    long n = (argc>=2) ? atol(argv[1]) : 10000000;
+    if(n <= 0) n = 1;
+
+    cout << "# routine isa flop ms" << endl;
+    for(size_t k=0; k<sizeof(kernels)/sizeof(kernels[0]); k++) {
+        if(!kernels[k].supported()) {
+            cout << "skip " << kernels[k].name << " " << kernels[k].isa << endl;
+            continue;
+        }
+        double t0 = wtime();
+        kernels[k].run(n);
+        double t1 = wtime();
+        cout << kernels[k].name << " " << kernels[k].isa << " " << kernels[k].flop * n
+             << " " << 1e3 * (t1 - t0) << endl;
+    }
+    return 0;
+}
+
+bool has_sse2() {
+    return __builtin_cpu_supports("sse2");
+}
+
+bool has_avx2() {
+    return __builtin_cpu_supports("avx2");
+}
+
+bool has_fma() {
+    return __builtin_cpu_supports("fma");
+}
+
+/* The OS support of the ZMM and mask registers is checked by __builtin_cpu_supports */
+bool has_avx512() {
+    return __builtin_cpu_supports("avx512f");
+}
+
+bool has_avx512fp16() {
+    unsigned int eax, ebx, ecx, edx;
+    if(!has_avx512() || !__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return false;
+    return (edx >> 23) & 1;
+}
+
+__attribute__((noinline)) void kernel_sse_scalar(long n) {
+    asm volatile("pxor %%xmm0, %%xmm0\n\tpxor %%xmm1, %%xmm1" : : : "xmm0", "xmm1");
+    ASM_LOOP(n, "mulsd %%xmm1, %%xmm0\n\t"
+                "addsd %%xmm1, %%xmm0\n\t", "xmm0", "xmm1");
+}
+
+__attribute__((noinline)) void kernel_sse_packed(long n) {
+    asm volatile("pxor %%xmm0, %%xmm0\n\tpxor %%xmm1, %%xmm1\n\tpxor %%xmm2, %%xmm2"
+                 : : : "xmm0", "xmm1", "xmm2");
+    ASM_LOOP(n, "mulpd %%xmm2, %%xmm0\n\t"
+                "addps %%xmm2, %%xmm1\n\t", "xmm0", "xmm1", "xmm2");
+}
+
+__attribute__((noinline)) void kernel_avx2(long n) {
+    asm volatile("vpxor %%ymm0, %%ymm0, %%ymm0\n\tvpxor %%ymm1, %%ymm1, %%ymm1\n\tvpxor %%ymm2, %%ymm2, %%ymm2"
+                 : : : "xmm0", "xmm1", "xmm2");
+    ASM_LOOP(n, "vmulpd %%ymm2, %%ymm0, %%ymm0\n\t"
+                "vaddps %%ymm2, %%ymm1, %%ymm1\n\t", "xmm0", "xmm1", "xmm2");
+    asm volatile("vzeroupper");
+}
+
+__attribute__((noinline)) void kernel_fma3(long n) {
+    asm volatile("vpxor %%ymm0, %%ymm0, %%ymm0\n\tvpxor %%ymm1, %%ymm1, %%ymm1\n\tvpxor %%ymm2, %%ymm2, %%ymm2"
+                 : : : "xmm0", "xmm1", "xmm2");
+    ASM_LOOP(n, "vfmadd231pd %%ymm2, %%ymm2, %%ymm0\n\t"
+                "vfmadd231sd %%xmm2, %%xmm2, %%xmm1\n\t", "xmm0", "xmm1", "xmm2");
+    asm volatile("vzeroupper");
+}
+
+__attribute__((noinline)) void kernel_avx512(long n) {
+    asm volatile("vpxord %%zmm0, %%zmm0, %%zmm0\n\tvpxord %%zmm1, %%zmm1, %%zmm1\n\tvpxord %%zmm2, %%zmm2, %%zmm2"
+                 : : : "xmm0", "xmm1", "xmm2");
+    ASM_LOOP(n, "vfmadd231ps %%zmm2, %%zmm2, %%zmm0\n\t"
+                "vmulpd %%zmm2, %%zmm1, %%zmm1\n\t", "xmm0", "xmm1", "xmm2");
+    asm volatile("vzeroupper");
+}
+
+/* k1 = 0x55: 4 of the 8 double lanes, k2 = 0x0f0f: 8 of the 16 single lanes */
+/* The mask registers can only be named in the clobbers of an AVX-512 target, which also adds the VZEROUPPER */
+__attribute__((noinline, target("avx512f"))) void kernel_avx512_masked(long n) {
+    asm volatile("vpxord %%zmm0, %%zmm0, %%zmm0\n\tvpxord %%zmm1, %%zmm1, %%zmm1\n\tvpxord %%zmm2, %%zmm2, %%zmm2\n\t"
+                 "movl $0x55, %%eax\n\tkmovw %%eax, %%k1\n\t"
+                 "movl $0x0f0f, %%eax\n\tkmovw %%eax, %%k2"
+                 : : : "eax", "xmm0", "xmm1", "xmm2", "k1", "k2");
+    ASM_LOOP(n, "vfmadd231pd %%zmm2, %%zmm2, %%zmm0%{%%k1%}\n\t"
+                "vaddps %%zmm2, %%zmm1, %%zmm1%{%%k2%}\n\t", "xmm0", "xmm1", "xmm2", "k1", "k2");
+}
+
+/* k1 is set to all lanes before the loop and cleared by the first (false) compare, */
+/* so counting on the destination instead of the write mask gives 8 FLOP in all */
+__attribute__((noinline, target("avx512f"))) void kernel_avx512_cmpmask(long n) {
+    asm volatile("vpxord %%zmm0, %%zmm0, %%zmm0\n\tvpxord %%zmm1, %%zmm1, %%zmm1\n\t"
+                 "movl $0xff, %%eax\n\tkmovw %%eax, %%k1\n\tmovl $0x03, %%eax\n\tkmovw %%eax, %%k2"
+                 : : : "eax", "xmm0", "xmm1", "k1", "k2");
+    ASM_LOOP(n, "vcmppd $1, %%zmm1, %%zmm0, %%k1%{%%k2%}\n\t", "xmm0", "xmm1", "k1", "k2");
+}
+
+/* The EVEX instructions are all in the AVX512 category of XED, only their FP arithmetic counts */
+__attribute__((noinline, target("avx512f"))) void kernel_avx512_nonflop(long n) {
+    asm volatile("vpxord %%zmm0, %%zmm0, %%zmm0\n\tvpxord %%zmm1, %%zmm1, %%zmm1\n\tvpxord %%zmm2, %%zmm2, %%zmm2\n\t"
+                 "movl $0x55, %%eax\n\tkmovw %%eax, %%k1"
+                 : : : "eax", "xmm0", "xmm1", "xmm2", "k1");
+    ASM_LOOP(n, "vmovapd %%zmm0, %%zmm2\n\t"
+                "vpermpd %%zmm2, %%zmm1, %%zmm0\n\t"
+                "vblendmpd %%zmm2, %%zmm1, %%zmm1%{%%k1%}\n\t"
+                "vcvttpd2dq %%zmm1, %%ymm3\n\t", "xmm0", "xmm1", "xmm2", "xmm3", "k1");
+}
+
+/* The two x87 registers are loaded and popped by x87_push and x87_pop, outside the kernel, */
+/* since FLD1 and FSTP are X87_ALU instructions with F80 operands and would count as FLOP */
+void run_x87(long n) {
+    x87_push();
+    kernel_x87(n);
+    x87_pop();
+}
+
+__attribute__((noinline)) void x87_push() {
+    asm volatile("fld1\n\tfld1");
+}
+
+__attribute__((noinline)) void kernel_x87(long n) {
+    ASM_LOOP(n, "fmul %%st(1), %%st\n\t"
+                "fadd %%st(1), %%st\n\t", "st", "st(1)");
+}
+
+__attribute__((noinline)) void x87_pop() {
+    asm volatile("fstp %%st(0)\n\tfstp %%st(0)" : : : "st", "st(1)");
+}
+
+__attribute__((noinline)) void kernel_fp16(long n) {
+    asm volatile("vpxord %%zmm0, %%zmm0, %%zmm0\n\tvpxord %%zmm1, %%zmm1, %%zmm1\n\tvpxord %%zmm2, %%zmm2, %%zmm2"
+                 : : : "xmm0", "xmm1", "xmm2");
+    ASM_LOOP(n, "vaddph %%zmm2, %%zmm0, %%zmm0\n\t"
+                "vfmadd231ph %%zmm2, %%zmm2, %%zmm1\n\t", "xmm0", "xmm1", "xmm2");
+    asm volatile("vzeroupper");
+}
+
+double wtime()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
@@ -0,0 +1,154 @@
+/*
+$ make
+$ pin -t obj-intel64/flop_counter.so -live /tmp/flop.live -- <application> &
+$ ./obj-intel64/flop_live.exe /tmp/flop.live [interval ms] [rounds]
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "live_counters.H"
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////
+// PROTOTYPES
+////////////////////////////////////////////////////////////////////////////
+
+int main(int, char *[]);
+bool snapshot(LIVE_HEADER *, vector<LIVE_COUNT> &, LIVE_COUNT *, uint32_t *);
+double wtime();
+
+////////////////////////////////////////////////////////////////////////////
+// INPLEMENTATIONS
+////////////////////////////////////////////////////////////////////////////
+
+/* Reader of the -live file of flop_counter: every interval, the FLOP/s and instructions/s */
+/* of the target routines, summed over all threads, from the counts of the last interval. */
+/* Without rounds it runs until the instrumented process is gone. */
+int main(int argc, char *argv[]) {
+    if(argc < 2) {
+        cerr << "usage: " << argv[0] << " <live file> [interval ms] [rounds]" << endl;
+        return 1;
+    }
+    int interval = (argc>=3) ? atoi(argv[2]) : 1000;
+    long rounds = (argc>=4) ? atol(argv[3]) : 0;
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(LIVE_HEADER)) {
+        cerr << "Cannot open the live file " << argv[1] << endl;
+        return 1;
+    }
+    void *map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        cerr << "Cannot map the live file " << argv[1] << endl;
+        return 1;
+    }
+    LIVE_HEADER *hdr = (LIVE_HEADER *)map;
+    if(memcmp(hdr->_magic, LIVE_MAGIC, 8) != 0 || hdr->_version != LIVE_VERSION
+       || (uint64_t)st.st_size < LIVE_fileSize(hdr->_rtnMax, hdr->_threadMax)) {
+        cerr << "Not a live file of version " << LIVE_VERSION << ": " << argv[1] << endl;
+        return 1;
+    }
+
+    vector<LIVE_COUNT> last(hdr->_rtnMax), cur(hdr->_rtnMax);
+    LIVE_COUNT lastTotal, curTotal;
+    uint32_t running;
+    if(!snapshot(hdr, last, &lastTotal, &running)) {
+        cerr << "The live file keeps changing" << endl;
+        return 1;
+    }
+    double t0 = wtime();
+
+    for(long r=0; rounds==0 || r<rounds; r++) {
+        usleep(interval * 1000);
+        bool alive = kill(hdr->_pid, 0) == 0;
+        if(!snapshot(hdr, cur, &curTotal, &running))
+            continue;
+        double t1 = wtime();
+        double dt = t1 - t0;
+
+        /* The routines with FLOP in this interval, the most FLOP/s first */
+        uint32_t num = min(__atomic_load_n(&hdr->_rtnNum, __ATOMIC_ACQUIRE), hdr->_rtnMax);
+        vector<pair<uint64_t, uint32_t> > order;
+        for(uint32_t i=0; i<num; i++)
+            if(cur[i]._icount > last[i]._icount)
+                order.push_back(make_pair(cur[i]._flopcount - last[i]._flopcount, i));
+        sort(order.rbegin(), order.rend());
+
+        cout << "###############################################" << endl;
+        cout << "pid " << hdr->_pid << ", " << running << " threads, "
+             << (curTotal._flopcount - lastTotal._flopcount) / dt / 1e6 << " MFLOP/s, "
+             << (curTotal._icount - lastTotal._icount) / dt / 1e6 << " Minstr/s";
+        if(hdr->_lost)
+            cout << ", " << hdr->_lost << " threads or routines not published";
+        cout << endl;
+        for(size_t k=0; k<order.size(); k++) {
+            uint32_t i = order[k].second;
+            cout << setw(14) << fixed << setprecision(2) << order[k].first / dt / 1e6 << " MFLOP/s "
+                 << setw(14) << (cur[i]._icount - last[i]._icount) / dt / 1e6 << " Minstr/s  "
+                 << string(LIVE_name(hdr, i), strnlen(LIVE_name(hdr, i), LIVE_NAME_LEN)) << endl;
+            cout.unsetf(ios::floatfield);
+        }
+
+        last.swap(cur);
+        lastTotal = curTotal;
+        t0 = t1;
+        if(!alive)
+            break;
+    }
+    return 0;
+}
+
+/* Sum the counts of all slots per routine ID and in total, and count the running threads. */
+/* Retry while a thread moves its counts to slot 0, so that they are summed exactly once. */
+bool snapshot(LIVE_HEADER *hdr, vector<LIVE_COUNT> &counts, LIVE_COUNT *total, uint32_t *running) {
+    vector<uint64_t> buf(hdr->_slotSize / 8);
+    LIVE_SLOT *slot = (LIVE_SLOT *)&buf[0];
+    LIVE_COUNT *rtn = LIVE_counts(slot);
+    for(int retry=0; retry<1000; retry++) {
+        uint64_t seq = __atomic_load_n(&hdr->_seq, __ATOMIC_ACQUIRE);
+        if(seq & 1)
+            continue;
+        memset(&counts[0], 0, counts.size() * sizeof(LIVE_COUNT));
+        total->_icount = total->_flopcount = 0;
+        *running = 0;
+        bool ok = true;
+        for(uint32_t s=0; s<hdr->_threadMax && ok; s++) {
+            ok = LIVE_readSlot(LIVE_slot(hdr, s), slot, hdr->_slotSize);
+            if(!ok || slot->_state == LIVE_FREE)
+                continue;
+            if(slot->_state == LIVE_RUNNING)
+                (*running)++;
+            total->_icount += slot->_icount;
+            total->_flopcount += slot->_flopcount;
+            for(uint32_t i=0; i<hdr->_rtnMax; i++) {
+                counts[i]._icount += rtn[i]._icount;
+                counts[i]._flopcount += rtn[i]._flopcount;
+            }
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(ok && __atomic_load_n(&hdr->_seq, __ATOMIC_RELAXED) == seq)
+            return true;
+    }
+    return false;
+}
+
+double wtime()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
@@ -0,0 +1,106 @@
+/*
+$ make
+$ ./obj-intel64/flop_loop.exe [iterations] [threads]
+*/
+
+#include <iostream>
+#include <cstdlib>
+#include <sys/time.h>
+#include <cassert>
+#include <pthread.h>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////
+// DEFINES
+////////////////////////////////////////////////////////////////////////////
+
+#define VECLEN 8
+
+////////////////////////////////////////////////////////////////////////////
+// PROTOTYPES
+////////////////////////////////////////////////////////////////////////////
+
+int main(int, char *[]);
+void *flop_worker(void *);
+void flop_kernel(double *, double, double);
+double wtime();
+
+////////////////////////////////////////////////////////////////////////////
+// INPLEMENTATIONS
+////////////////////////////////////////////////////////////////////////////
+
+/* A long-running FLOP loop: 2 * VECLEN FLOP per iteration. */
+/* Without threads, the loop stays in main so that it is counted by the default target routine. */
+/* With threads, every thread runs the loop and calls the small routine flop_kernel per iteration. */
+int main(int argc, char *argv[]) {
+    long n = (argc>=2) ? atol(argv[1]) : 100000000;
+    int nthreads = (argc>=3) ? atoi(argv[2]) : 0;
+    double x[VECLEN], a = 0.999999, b = 1e-6;
+    for(int j=0; j<VECLEN; j++) x[j] = j;
+
+    if(nthreads > 0) {
+        pthread_t* thread = new pthread_t[nthreads];
+        int r;
+        double t0 = wtime();
+        for(int i=0;i<nthreads;i++) {
+            r = pthread_create(thread+i, 0, flop_worker, &n);
+            assert(r==0);
+        }
+        for(int i=0;i<nthreads;i++) {
+            r = pthread_join(thread[i], 0);
+            assert(r==0);
+        }
+        double t1 = wtime();
+        delete [] thread;
+
+        cout << "###############################################" << endl;
+        cout << "flop_loop: " << nthreads << " threads x " << n << " iterations" << endl;
+        cout << "time:       " << 1e3 * (t1 - t0) << "ms" << endl;
+        cout << "throughput: " << nthreads * n / (t1 - t0) << " iterations/s" << endl;
+        cout << "###############################################" << endl;
+        return 0;
+    }
+
+    double t0 = wtime();
+    for(long i=0; i<n; i++) {
+        for(int j=0; j<VECLEN; j++) {
+            x[j] = x[j] * a + b;
+        }
+    }
+    double t1 = wtime();
+
+    double sum = 0;
+    for(int j=0; j<VECLEN; j++) sum += x[j];
+
+    cout << "###############################################" << endl;
+    cout << "flop_loop: " << n << " iterations, " << 2.0 * VECLEN * n << " FLOP" << endl;
+    cout << "checksum:  " << sum << endl;
+    cout << "time:      " << 1e3 * (t1 - t0) << "ms" << endl;
+    cout << "###############################################" << endl;
+
+    return 0;
+}
+
+void *flop_worker(void *arg) {
+    long n = *(long *)arg;
+    double x[VECLEN], a = 0.999999, b = 1e-6;
+    for(int j=0; j<VECLEN; j++) x[j] = j;
+    for(long i=0; i<n; i++) {
+        flop_kernel(x, a, b);
+    }
+    return x[0] < 0 ? arg : NULL;
+}
+
+__attribute__((noinline)) void flop_kernel(double *x, double a, double b) {
+    for(int j=0; j<VECLEN; j++) {
+        x[j] = x[j] * a + b;
+    }
+}
+
+double wtime()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
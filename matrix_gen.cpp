@@ -0,0 +1,191 @@
+/*
+$ make
+$ ./obj-intel64/matrix_gen.exe <dense|sparse> <rows> <cols> <density> <out file> [seed]
+$ ./obj-intel64/matrix_gen.exe sparse 1000000 1000000 0.00001 A.bin
+$ ./obj-intel64/matrix_gen.exe dense 1024 1024 1 A.mtx
+*/
+
+#include <iostream>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <stdint.h>
+#include "matrix_io.H"
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////
+// PROTOTYPES
+////////////////////////////////////////////////////////////////////////////
+
+int main(int, char *[]);
+uint64_t mix(uint64_t);
+double entry(uint64_t, long, long);
+bool dense_nonzero(uint64_t, long, long, double);
+void sparse_row(uint64_t, long, int, int, vector<int> &, vector<char> &);
+void write_dense(FILE *, bool, uint64_t, int, int, double);
+void write_sparse(FILE *, bool, uint64_t, int, int, int);
+
+////////////////////////////////////////////////////////////////////////////
+// INPLEMENTATIONS
+////////////////////////////////////////////////////////////////////////////
+
+/* Random input matrices for matrix_multiplications, with a controlled density: */
+/*   dense:  every entry is nonzero with the probability density */
+/*   sparse: every row has exactly round(density * cols) nonzeros in distinct random columns */
+/* A .mtx file is written in the Matrix Market format (coordinate for sparse, array for dense), */
+/* any other file in the binary format of matrix_io.H. The values are in (0, 1] and depend */
+/* only on the seed and their position, so the same arguments always give the same matrix. */
+int main(int argc, char *argv[]) {
+    if(argc < 6) {
+        cerr << "usage: " << argv[0] << " <dense|sparse> <rows> <cols> <density> <out file> [seed]" << endl;
+        return 1;
+    }
+    bool dense = strcmp(argv[1], "dense") == 0;
+    long m = atol(argv[2]), n = atol(argv[3]);
+    double density = atof(argv[4]);
+    const char *file = argv[5];
+    uint64_t seed = (argc>=7) ? strtoull(argv[6], NULL, 0) : 1;
+    if((!dense && strcmp(argv[1], "sparse") != 0) || m < 0 || n < 0 || m > INT_MAX || n > INT_MAX - DENSE_ALIGN
+       || density < 0 || density > 1) {
+        cerr << "Bad arguments, the density is in [0, 1] and the sizes below 2^31" << endl;
+        return 1;
+    }
+    size_t len = strlen(file);
+    bool mtx = len >= 4 && strcmp(file + len - 4, ".mtx") == 0;
+
+    long k = (long)(density * n + 0.5);
+    if(!dense && m * k > INT_MAX) {
+        cerr << "Too many nonzeros for a compressed-row matrix: " << m * k << endl;
+        return 1;
+    }
+
+    FILE *out = fopen(file, "wb");
+    if(out == NULL) {
+        cerr << "Cannot create " << file << endl;
+        return 1;
+    }
+    static char buf[1 << 20];
+    setvbuf(out, buf, _IOFBF, sizeof(buf));
+    if(dense)
+        write_dense(out, mtx, seed, (int)m, (int)n, density);
+    else
+        write_sparse(out, mtx, seed, (int)m, (int)n, (int)k);
+    if(ferror(out) || fclose(out) != 0) {
+        cerr << "Cannot write " << file << endl;
+        return 1;
+    }
+    return 0;
+}
+
+/* The splitmix64 finalizer */
+uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* The value of the entry (i, j), in (0, 1] */
+double entry(uint64_t seed, long i, long j) {
+    uint64_t h = mix(mix(mix(seed) ^ (uint64_t)i) ^ ((uint64_t)j << 1 | 1));
+    return ((h >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+/* Whether the entry (i, j) of a dense matrix is nonzero, independent of its value */
+bool dense_nonzero(uint64_t seed, long i, long j, double density) {
+    if(density >= 1) return true;
+    uint64_t h = mix(mix(mix(seed ^ 0x5bd1e995) ^ (uint64_t)i) ^ (uint64_t)j);
+    return (h >> 11) * (1.0 / 9007199254740992.0) < density;
+}
+
+/* The k columns of row i of a sparse matrix, sorted: Floyd's sampling of k distinct numbers */
+/* in [0, n), with a marker array of n entries that is cleared again after the row */
+void sparse_row(uint64_t seed, long i, int n, int k, vector<int> &cols, vector<char> &marker) {
+    uint64_t state = mix(seed ^ 0xa0761d6478bd642fULL) ^ (uint64_t)i;
+    cols.clear();
+    for(int j=n-k; j<n; j++) {
+        state = mix(state);
+        int t = (int)(state % (uint64_t)(j + 1));
+        if(marker[t]) t = j;
+        marker[t] = 1;
+        cols.push_back(t);
+    }
+    for(size_t c=0; c<cols.size(); c++) marker[cols[c]] = 0;
+    sort(cols.begin(), cols.end());
+}
+
+/* The binary form is written row by row with its padding columns set to 0, */
+/* the Matrix Market array form column by column */
+void write_dense(FILE *out, bool mtx, uint64_t seed, int m, int n, double density) {
+    if(mtx) {
+        fprintf(out, "%%%%MatrixMarket matrix array real general\n");
+        fprintf(out, "%% matrix_gen dense, density %g, seed %llu\n", density, (unsigned long long)seed);
+        fprintf(out, "%d %d\n", m, n);
+        for(long j=0; j<n; j++)
+            for(long i=0; i<m; i++)
+                fprintf(out, "%.17g\n", dense_nonzero(seed, i, j, density) ? entry(seed, i, j) : 0.0);
+        return;
+    }
+    MATRIX_BIN_HEADER h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MATRIX_BIN_MAGIC, 8);
+    h.form = MATRIX_DENSE;
+    h.m = m;
+    h.n = n;
+    h.ld = (n + DENSE_ALIGN - 1) / DENSE_ALIGN * DENSE_ALIGN;
+    fwrite(&h, sizeof(h), 1, out);
+    vector<double> row(h.ld, 0.0);
+    for(long i=0; i<m; i++) {
+        for(long j=0; j<n; j++)
+            row[j] = dense_nonzero(seed, i, j, density) ? entry(seed, i, j) : 0.0;
+        fwrite(&row[0], sizeof(double), h.ld, out);
+    }
+}
+
+/* Every row has k entries, so the row pointers are known up front, and the columns of a row */
+/* are sampled again for the values instead of keeping the whole matrix in memory */
+void write_sparse(FILE *out, bool mtx, uint64_t seed, int m, int n, int k) {
+    vector<int> cols;
+    vector<char> marker(n > 0 ? n : 1, 0);
+    long nnz = (long)m * k;
+    if(mtx) {
+        fprintf(out, "%%%%MatrixMarket matrix coordinate real general\n");
+        fprintf(out, "%% matrix_gen sparse, %d nonzeros per row, seed %llu\n", k, (unsigned long long)seed);
+        fprintf(out, "%d %d %ld\n", m, n, nnz);
+        for(long i=0; i<m; i++) {
+            sparse_row(seed, i, n, k, cols, marker);
+            for(int c=0; c<k; c++)
+                fprintf(out, "%ld %d %.17g\n", i + 1, cols[c] + 1, entry(seed, i, cols[c]));
+        }
+        return;
+    }
+    MATRIX_BIN_HEADER h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MATRIX_BIN_MAGIC, 8);
+    h.form = MATRIX_CSR;
+    h.m = m;
+    h.n = n;
+    h.nnz = nnz;
+    fwrite(&h, sizeof(h), 1, out);
+    for(long i=0; i<=m; i++) {
+        int p = (int)(i * k);
+        fwrite(&p, sizeof(int), 1, out);
+    }
+    for(long i=0; i<m; i++) {
+        sparse_row(seed, i, n, k, cols, marker);
+        fwrite(cols.data(), sizeof(int), k, out);
+    }
+    if(((size_t)m + 1 + nnz) & 1) {
+        int pad = 0;
+        fwrite(&pad, sizeof(int), 1, out);
+    }
+    vector<double> vals(k > 0 ? k : 1);
+    for(long i=0; i<m; i++) {
+        sparse_row(seed, i, n, k, cols, marker);
+        for(int c=0; c<k; c++) vals[c] = entry(seed, i, cols[c]);
+        fwrite(&vals[0], sizeof(double), k, out);
+    }
+}
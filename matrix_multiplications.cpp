@@ -1,17 +1,22 @@
 /*
 $ make
+$ ./obj-intel64/matrix_multiplications.exe [threads] [naive|blocked|all] [A file] [B file]
+$ ./obj-intel64/matrix_gen.exe sparse 1000000 1000000 0.00001 A.bin
 $ rm -rf ./obj-intel64/sparse_matrix.exe; g++ -g -Wall sparse_matrix.cpp -o ./obj-intel64/sparse_matrix.exe; ./obj-intel64/sparse_matrix.exe
 $ valgrind --tool=memcheck --leak-check=full -s ./obj-intel64/sparse_matrix.exe
 */
 
 #include <iostream>
-#include <fstream>
 #include <string>
-#include <sstream>
 #include <string.h>
+#include <stdlib.h>
 #include <sys/time.h>
 #include <cassert>
 #include<pthread.h>
+#include <immintrin.h>
+#include <climits>
+#include <algorithm>
+#include "matrix_io.H"
 
 using namespace std;
 
@@ -19,21 +24,23 @@ using namespace std;
 // DEFINES
 ////////////////////////////////////////////////////////////////////////////
 
+/* Tiles of the blocked GEMM: a GEMM_KC x GEMM_NC block of B stays in L2, */
+/* a GEMM_MC x GEMM_KC block of A in L1/L2 while it is multiplied with it */
+#define GEMM_MC 64
+#define GEMM_KC 256
+#define GEMM_NC 512
+
+/* Largest sparse input expanded to a dense one for multiplyMatrix and multiplyDenseMatrix, in elements */
+#define DENSE_MAX (1L << 26)
+
 ////////////////////////////////////////////////////////////////////////////
 // TYPES
 ////////////////////////////////////////////////////////////////////////////
 
-/* --- primary CSparse routines and data structures --- */
-typedef struct cs_sparse    /* matrix in compressed-column or triplet form */
-{
-    int nzmax ;     /* maximum number of entries */
-    int m ;         /* number of rows */
-    int n ;         /* number of columns */
-    int *p ;        /* column pointers (size n+1) or col indices (size nzmax) */
-    int *i ;        /* row indices, size nzmax */
-    double *x ;          /* numerical values, size nzmax */
-    int nz ;        /* # of entries in triplet matrix, -1 for compressed-col */
-} cs ;
+/* cs, dm and the input matrices mat: see matrix_io.H */
+
+/* The GEMM variants, selected by the second argument */
+enum { GEMM_NAIVE = 1, GEMM_BLOCKED = 2, GEMM_ALL = 3 };
 
 ////////////////////////////////////////////////////////////////////////////
 // PROTOTYPES
@@ -41,11 +48,19 @@ typedef struct cs_sparse    /* matrix in compressed-column or triplet form */
 
 int main(int, char *[]);
 void *child(void *);
+void load_input(const char *, mat *);
+void run_products(const char *, int);
 void print_matrix(double **, int, int);
 void print_sparse_matrix(cs *, int);
 void trans2SparseMatrix(double **, int, int, cs *);
 void multiplyMatrix(double **, int *, int *, double **, int *, int *, double **, int *, int *);
 void multiplySparseMatrix(cs *, cs *, cs *);
+double diffDenseMatrix(double **, dm *);
+void multiplyDenseMatrix(dm *, dm *, dm *);
+void multiplyDenseMatrix_avx512(dm *, dm *, dm *);
+void multiplyDenseMatrix_avx2(dm *, dm *, dm *);
+void multiplyDenseMatrix_generic(dm *, dm *, dm *);
+const char *gemm_isa();
 double wtime();
 
 ////////////////////////////////////////////////////////////////////////////
@@ -53,15 +68,37 @@ double wtime();
 ////////////////////////////////////////////////////////////////////////////
 
 pthread_mutex_t mutex;
+int gemm_mode = GEMM_ALL;
+
+/* The input matrices, loaded once by main before the threads start and only read by them */
+mat inputA, inputB;
 
 ////////////////////////////////////////////////////////////////////////////
 // INPLEMENTATIONS
 ////////////////////////////////////////////////////////////////////////////
 
+/* matrix_multiplications.exe [threads] [naive|blocked|all] [A file] [B file] */
+/* The inputs default to matrixA.txt and matrixB.txt, and to a 4x4 matrix without them. */
 int main(int argc, char *argv[]) {
 
     pthread_attr_t attr;
-    int nthreads = (argc==2) ? atoi(argv[1]) : 4;
+    int nthreads = (argc>=2) ? atoi(argv[1]) : 4;
+    if(argc>=3) {
+        if(strcmp(argv[2], "naive") == 0) gemm_mode = GEMM_NAIVE;
+        else if(strcmp(argv[2], "blocked") == 0) gemm_mode = GEMM_BLOCKED;
+        else if(strcmp(argv[2], "all") != 0) {
+            cerr << "usage: " << argv[0] << " [threads] [naive|blocked|all] [A file] [B file]" << endl;
+            return 1;
+        }
+    }
+
+    double t0 = wtime();
+    load_input((argc>=4) ? argv[3] : "matrixA.txt", &inputA);
+    load_input((argc>=5) ? argv[4] : "matrixB.txt", &inputB);
+    double t1 = wtime();
+    cout << "Inputs loaded in " << 1e3 * (t1 - t0) << "ms: A(" << inputA.m << "x" << inputA.n << ", "
+         << inputA.s.nzmax << " nonzeros), B(" << inputB.m << "x" << inputB.n << ", " << inputB.s.nzmax << " nonzeros)" << endl;
+
     pthread_t* thread = new pthread_t[nthreads];
     int r;
     r = pthread_mutex_init(&mutex, 0);
@@ -76,123 +113,9 @@ int main(int argc, char *argv[]) {
         assert(r==0);
     }
 
-    string str = "";
-    stringstream ss;
-    ifstream fileA, fileB;
-
-    double my_default_matrix[4][4] = {{1, 2, 0, 0},
-                                      {7, 0, 0, 4},
-                                      {0, 0, 0, 1},
-                                      {0, 9, 8, 1}};
-    int Ar=4, Ac=4, Br=4, Bc=4;
-
-    fileA.open("matrixA.txt", ios::in);
-    fileB.open("matrixB.txt", ios::in);
-
-    if(fileA.is_open()) {
-        getline(fileA, str);
-        ss.clear(); ss << str; ss >> Ar; ss >> Ac;
-    }
-
-    if(fileB.is_open()) {
-        getline(fileB, str);
-        ss.clear(); ss << str; ss >> Br; ss >> Bc;
-    }
-
-    double matrixA[Ar][Ac], matrixB[Br][Bc];
-    double *p_matrixA[Ar], *p_matrixB[Br];
-    int Ai=0, Bi=0;
-
-    if(fileA.is_open()) {
-        while(!fileA.eof()) {
-            getline(fileA, str); 
-            ss.clear(); ss << str;
-            for(int i=0; i<Ac; i++) ss >> matrixA[Ai][i];
-            Ai++;
-        }
-        for(int i=0; i<Ar; i++) p_matrixA[i] = &matrixA[i][0];
-    }
-    else {
-        for(int i=0; i<Ar; i++) p_matrixA[i] = &my_default_matrix[i][0];
-    }
-
-    if(fileB.is_open()) {
-        while(!fileB.eof()) {
-            getline(fileB, str); 
-            ss.clear(); ss << str;
-            for(int i=0; i<Ac; i++) ss >> matrixB[Bi][i];
-            Bi++;
-        }
-        for(int i=0; i<Br; i++) p_matrixB[i] = &matrixB[i][0];
-    }
-    else {
-        for(int i=0; i<Br; i++) p_matrixB[i] = &my_default_matrix[i][0];
-    }
-
-    // print_matrix(p_matrixA, Ar, Ac);
-    // print_matrix(p_matrixB, Br, Bc);
-
-    fileA.close();
-    fileB.close();
-
-    cs sparse_matrixA, sparse_matrixB, sparse_matrixC;
-    int Cr=Ar, Cc=Bc;
-    double ** p_matrix_c = new double *[Cr];
-    trans2SparseMatrix(p_matrixA, Ar, Ac, &sparse_matrixA);
-    trans2SparseMatrix(p_matrixB, Br, Bc, &sparse_matrixB);
-
     r = pthread_mutex_lock(&mutex);
     assert(r==0);
-
-    double t0, t1, t2, t3, t4;
-    t0 = wtime();
-    multiplyMatrix(p_matrixA, &Ar, &Ac, p_matrixB, &Br, &Bc, p_matrix_c, &Cr, &Cc);
-    t1 = wtime();
-    multiplySparseMatrix(&sparse_matrixA, &sparse_matrixB, &sparse_matrixC);
-    t2 = wtime();
-    multiplyMatrix(p_matrixA, &Ar, &Ac, p_matrixB, &Br, &Bc, p_matrix_c, &Cr, &Cc);
-    t3 = wtime();
-    multiplySparseMatrix(&sparse_matrixA, &sparse_matrixB, &sparse_matrixC);
-    t4 = wtime();
-
-    // print_sparse_matrix(&sparse_matrixC, 0);
-    // print_matrix(p_matrix_c, Cr, Cc);
-
-    cout << "###############################################" << endl;
-    cout << "Mother" << endl;
-    cout << "###############################################" << endl;
-    cout << "A(" << Ar << "x" << Ac << ") multiply by B(" << Br << "x" << Bc << "): " << endl;
-    cout << "multiplyMatrix:       " << 1e6 * (t1 - t0) << "ms" << endl;
-    cout << "multiplySparseMatrix: " << 1e6 * (t2 - t1) << "ms" << endl;
-    cout << "multiplyMatrix:       " << 1e6 * (t3 - t2) << "ms" << endl;
-    cout << "multiplySparseMatrix: " << 1e6 * (t4 - t3) << "ms" << endl;
-    cout << "###############################################" << endl;
-
-    delete [] sparse_matrixA.p;
-    sparse_matrixA.p = NULL;
-    delete [] sparse_matrixA.i;
-    sparse_matrixA.i = NULL;
-    delete [] sparse_matrixA.x;
-    sparse_matrixA.x = NULL;
-    delete [] sparse_matrixB.p;
-    sparse_matrixB.p = NULL;
-    delete [] sparse_matrixB.i;
-    sparse_matrixB.i = NULL;
-    delete [] sparse_matrixB.x;
-    sparse_matrixB.x = NULL;
-    delete [] sparse_matrixC.p;
-    sparse_matrixC.p = NULL;
-    delete [] sparse_matrixC.i;
-    sparse_matrixC.i = NULL;
-    delete [] sparse_matrixC.x;
-    sparse_matrixC.x = NULL;
-    for(int i=0; i<Cc; i++) {
-        delete [] *(p_matrix_c+i);
-        *(p_matrix_c+i) = NULL;
-    }
-    delete [] p_matrix_c;
-    p_matrix_c = NULL;
-
+    run_products("Mother", 2);
     r = pthread_mutex_unlock(&mutex);
     assert(r==0);
 
@@ -200,7 +123,10 @@ int main(int argc, char *argv[]) {
         r = pthread_join(thread[i], 0);
         assert(r==0);
     }
+    delete [] thread;
 
+    matrix_free(&inputA);
+    matrix_free(&inputB);
     return 0;
 }
 
@@ -208,119 +134,102 @@ void *child(void *arg) {
     int r;
     r = pthread_mutex_lock(&mutex);
     assert(r==0);
+    run_products("Child", 1);
+    r =pthread_mutex_unlock(&mutex);
+    assert(r==0);
+    pthread_exit(NULL);
+}
 
-    string str = "";
-    stringstream ss;
-    ifstream fileA, fileB;
-
+/* Load an input matrix and complete the forms the products need: */
+/* the compressed-row form always, the dense one and its row pointers up to DENSE_MAX elements */
+void load_input(const char *file, mat *Xo_matrix) {
     double my_default_matrix[4][4] = {{1, 2, 0, 0},
                                       {7, 0, 0, 4},
                                       {0, 0, 0, 1},
                                       {0, 9, 8, 1}};
-    int Ar=4, Ac=4, Br=4, Bc=4;
-
-    fileA.open("matrixA.txt", ios::in);
-    fileB.open("matrixB.txt", ios::in);
-
-    if(fileA.is_open()) {
-        getline(fileA, str);
-        ss.clear(); ss << str; ss >> Ar; ss >> Ac;
+    if(!matrix_load(file, Xo_matrix)) {
+        Xo_matrix->m = Xo_matrix->n = 4;
+        dense_init(&Xo_matrix->d, 4, 4);
+        for(int i=0; i<4; i++)
+            memcpy(Xo_matrix->d.x + i * Xo_matrix->d.ld, my_default_matrix[i], sizeof(my_default_matrix[i]));
+        Xo_matrix->forms = Xo_matrix->owned = MATRIX_DENSE;
     }
 
-    if(fileB.is_open()) {
-        getline(fileB, str);
-        ss.clear(); ss << str; ss >> Br; ss >> Bc;
+    int m = Xo_matrix->m, n = Xo_matrix->n;
+    dm *d = &Xo_matrix->d;
+    cs *s = &Xo_matrix->s;
+    if(!(Xo_matrix->forms & MATRIX_DENSE) && (long)m * n <= DENSE_MAX) {
+        dense_init(d, m, n);
+        for(int i=0; i<m; i++)
+            for(int k=s->p[i]; k<s->p[i+1]; k++)
+                d->x[(size_t)i * d->ld + s->i[k]] += s->x[k];
+        Xo_matrix->forms |= MATRIX_DENSE;
+        Xo_matrix->owned |= MATRIX_DENSE;
     }
-
-    double matrixA[Ar][Ac], matrixB[Br][Bc];
-    double *p_matrixA[Ar], *p_matrixB[Br];
-    int Ai=0, Bi=0;
-
-    if(fileA.is_open()) {
-        while(!fileA.eof()) {
-            getline(fileA, str); 
-            ss.clear(); ss << str;
-            for(int i=0; i<Ac; i++) ss >> matrixA[Ai][i];
-            Ai++;
-        }
-        for(int i=0; i<Ar; i++) p_matrixA[i] = &matrixA[i][0];
+    if(Xo_matrix->forms & MATRIX_DENSE) {
+        Xo_matrix->rows = new double *[m > 0 ? m : 1];
+        for(int i=0; i<m; i++) Xo_matrix->rows[i] = d->x + (size_t)i * d->ld;
     }
-    else {
-        for(int i=0; i<Ar; i++) p_matrixA[i] = &my_default_matrix[i][0];
+    if(!(Xo_matrix->forms & MATRIX_CSR)) {
+        trans2SparseMatrix(Xo_matrix->rows, m, n, s);
+        Xo_matrix->forms |= MATRIX_CSR;
+        Xo_matrix->owned |= MATRIX_CSR;
     }
+}
 
-    if(fileB.is_open()) {
-        while(!fileB.eof()) {
-            getline(fileB, str); 
-            ss.clear(); ss << str;
-            for(int i=0; i<Ac; i++) ss >> matrixB[Bi][i];
-            Bi++;
-        }
-        for(int i=0; i<Br; i++) p_matrixB[i] = &matrixB[i][0];
-    }
-    else {
-        for(int i=0; i<Br; i++) p_matrixB[i] = &my_default_matrix[i][0];
-    }
-
-    // print_matrix(p_matrixA, Ar, Ac);
-    // print_matrix(p_matrixB, Br, Bc);
-
-    fileA.close();
-    fileB.close();
-
-    cs sparse_matrixA, sparse_matrixB, sparse_matrixC;
-    int Cr=Ar, Cc=Bc;
-    double ** p_matrix_c = new double *[Cr];
-    trans2SparseMatrix(p_matrixA, Ar, Ac, &sparse_matrixA);
-    trans2SparseMatrix(p_matrixB, Br, Bc, &sparse_matrixB);
-
-    double t0, t1, t2;
-    t0 = wtime();
-    multiplyMatrix(p_matrixA, &Ar, &Ac, p_matrixB, &Br, &Bc, p_matrix_c, &Cr, &Cc);
-    t1 = wtime();
-    multiplySparseMatrix(&sparse_matrixA, &sparse_matrixB, &sparse_matrixC);
-    t2 = wtime();
-
-    // print_sparse_matrix(&sparse_matrixC, 0);
-    // print_matrix(p_matrix_c, Cr, Cc);
-
+/* Run the products of one thread on the shared inputs, rounds times, and print their times. */
+/* The dense products are skipped for inputs too large for a dense form. */
+void run_products(const char *who, int rounds) {
+    int Ar = inputA.m, Ac = inputA.n, Br = inputB.m, Bc = inputB.n;
+    int Cr = Ar, Cc = Bc;
+    /* The product is as large as the inputs are limited to */
+    bool dense = (inputA.forms & inputB.forms & MATRIX_DENSE) != 0 && (long)Cr * Cc <= DENSE_MAX;
+    double ** p_matrix_c = new double *[Cr > 0 ? Cr : 1]();
+    dm dense_matrixC;
+    if(dense && (gemm_mode & GEMM_BLOCKED))
+        dense_init(&dense_matrixC, Cr, Cc);
 
     cout << "###############################################" << endl;
-    cout << "Child" << endl;
+    cout << who << endl;
     cout << "###############################################" << endl;
     cout << "A(" << Ar << "x" << Ac << ") multiply by B(" << Br << "x" << Bc << "): " << endl;
-    cout << "multiplyMatrix:       " << 1e6 * (t1 - t0) << "ms" << endl;
-    cout << "multiplySparseMatrix: " << 1e6 * (t2 - t1) << "ms" << endl;
+    for(int round=0; round<rounds; round++) {
+        double t0, t1, t2, t3;
+        cs sparse_matrixC;
+        t0 = wtime();
+        if(dense && (gemm_mode & GEMM_NAIVE))
+            multiplyMatrix(inputA.rows, &Ar, &Ac, inputB.rows, &Br, &Bc, p_matrix_c, &Cr, &Cc);
+        t1 = wtime();
+        multiplySparseMatrix(&inputA.s, &inputB.s, &sparse_matrixC);
+        t2 = wtime();
+        if(dense && (gemm_mode & GEMM_BLOCKED))
+            multiplyDenseMatrix(&inputA.d, &inputB.d, &dense_matrixC);
+        t3 = wtime();
+
+        // print_sparse_matrix(&sparse_matrixC, 0);
+        // print_matrix(p_matrix_c, Cr, Cc);
+
+        if(dense && (gemm_mode & GEMM_NAIVE))
+            cout << "multiplyMatrix:       " << 1e3 * (t1 - t0) << "ms" << endl;
+        cout << "multiplySparseMatrix: " << 1e3 * (t2 - t1) << "ms, " << sparse_matrixC.nzmax << " nonzeros" << endl;
+        if(dense && (gemm_mode & GEMM_BLOCKED))
+            cout << "multiplyDenseMatrix:  " << 1e3 * (t3 - t2) << "ms (" << gemm_isa() << ")" << endl;
+        csr_free(&sparse_matrixC);
+    }
+    if(!dense)
+        cout << "multiplyMatrix, multiplyDenseMatrix: skipped, the inputs or the product are larger than " << DENSE_MAX << " elements" << endl;
+    else if(gemm_mode == GEMM_ALL)
+        cout << "max |naive - blocked|: " << diffDenseMatrix(p_matrix_c, &dense_matrixC) << endl;
     cout << "###############################################" << endl;
 
-    delete [] sparse_matrixA.p;
-    sparse_matrixA.p = NULL;
-    delete [] sparse_matrixA.i;
-    sparse_matrixA.i = NULL;
-    delete [] sparse_matrixA.x;
-    sparse_matrixA.x = NULL;
-    delete [] sparse_matrixB.p;
-    sparse_matrixB.p = NULL;
-    delete [] sparse_matrixB.i;
-    sparse_matrixB.i = NULL;
-    delete [] sparse_matrixB.x;
-    sparse_matrixB.x = NULL;
-    delete [] sparse_matrixC.p;
-    sparse_matrixC.p = NULL;
-    delete [] sparse_matrixC.i;
-    sparse_matrixC.i = NULL;
-    delete [] sparse_matrixC.x;
-    sparse_matrixC.x = NULL;
-    for(int i=0; i<Cc; i++) {
+    for(int i=0; i<Cr; i++) {
         delete [] *(p_matrix_c+i);
         *(p_matrix_c+i) = NULL;
     }
     delete [] p_matrix_c;
     p_matrix_c = NULL;
-
-    r =pthread_mutex_unlock(&mutex);
-    assert(r==0);
-    pthread_exit(NULL);
+    if(dense && (gemm_mode & GEMM_BLOCKED))
+        dense_free(&dense_matrixC);
 }
 
 void print_matrix(double **Xi_matrix, int row, int col) {
@@ -366,31 +275,30 @@ void print_sparse_matrix(cs *Xi_sparseMatrix, int setup = 0) {
     cout << "###############################################" << endl;
 }
 
+/* The nonzeros of a dense matrix in compressed-row form, counted first so that it gets exactly nzmax entries */
 void trans2SparseMatrix(double **Xi_matrix, int row, int col, cs *Xo_sparseMatrix) {
-    Xo_sparseMatrix->nzmax = 0;
-    Xo_sparseMatrix->m = row;
-    Xo_sparseMatrix->n = col;
-    Xo_sparseMatrix->nz = -1;
-    int *l_p = new int[row+1];
-    int *l_i = new int[row*col];
-    double *l_x = new double[row*col];
+    long nnz = 0;
+    for(int i=0; i<row; i++)
+        for(int j=0 ;j<col; j++)
+            if(Xi_matrix[i][j] != 0) nnz++;
+    csr_init(Xo_sparseMatrix, row, col, nnz);
+    int *l_p = Xo_sparseMatrix->p;
+    int *l_i = Xo_sparseMatrix->i;
+    double *l_x = Xo_sparseMatrix->x;
 
     // print_matrix(Xi_matrix, row, col);
-    *(l_p) = Xo_sparseMatrix->nzmax;
+    int k = 0;
+    *(l_p) = 0;
     for(int i=0; i<row; i++) {
         for(int j=0 ;j<col; j++) {
             if(Xi_matrix[i][j] != 0) {
-                *(l_i + Xo_sparseMatrix->nzmax) = j;
-                *(l_x + Xo_sparseMatrix->nzmax) = Xi_matrix[i][j];
-                Xo_sparseMatrix->nzmax += 1;
+                *(l_i + k) = j;
+                *(l_x + k) = Xi_matrix[i][j];
+                k++;
             }
-            *(l_p+i+1) = Xo_sparseMatrix->nzmax;
         }
+        *(l_p+i+1) = k;
     }
-    // print_matrix(Xi_matrix, row, col);
-    Xo_sparseMatrix->p = l_p;
-    Xo_sparseMatrix->i = l_i;
-    Xo_sparseMatrix->x = l_x;
     // print_sparse_matrix(Xo_sparseMatrix, 1);
 }
 
@@ -404,11 +312,13 @@ void multiplyMatrix(double **Xi_MatrixA, int *Xi_Arow, int *Xi_Acol,
     // double *l_Matrix = new double(*Xi_Bcol);
     // double *l_Matrix = new (double)(*Xi_Bcol);
 
+    /* The rows of C are allocated by the first call and reused by the next ones */
     for(int i=0; i<(*Xi_Arow); i++) {
-        *(Xo_MatrixC+i) = new double[(*Xi_Bcol)];
+        if(*(Xo_MatrixC+i) == NULL)
+            *(Xo_MatrixC+i) = new double[(*Xi_Bcol)];
         memset(*(Xo_MatrixC+i), 0, sizeof(double) * (*Xi_Bcol));
-        for(int j=0; j<(*Xi_Acol); j++) {
-            for(int k=0; k<(*Xi_Bcol); k++) {
+        for(int j=0; j<(*Xi_Bcol); j++) {
+            for(int k=0; k<(*Xi_Acol); k++) {
                 *(*(Xo_MatrixC+i)+j) += *(*(Xi_MatrixA+i)+k) * *(*(Xi_MatrixB+k)+j);
                 // *(*(Xo_MatrixC+i)+j) += Xi_MatrixA[i][k] * Xi_MatrixB[k][j];
             }
@@ -418,21 +328,15 @@ void multiplyMatrix(double **Xi_MatrixA, int *Xi_Arow, int *Xi_Acol,
     return;
 }
 
+/* Gustavson's row-by-row SpGEMM on compressed-row matrices, C = A * B. */
+/* A symbolic pass counts the columns of every row of C, so that C gets exactly nzmax entries, */
+/* then the numeric pass accumulates every row in a sparse accumulator: a dense value array */
+/* and a marker array of the row that last touched a column, so nothing is reset between rows */
+/* and the work is O(flops + m + n) instead of O(m * n). The entries of a row are sorted by */
+/* column; an entry whose products cancel out is kept as a structural 0. */
 void multiplySparseMatrix(cs *Xi_sparseMatrixA, cs *Xi_sparseMatrixB, cs *Xo_sparseMatrixC) {
     if(Xi_sparseMatrixA->n != Xi_sparseMatrixB->m) exit (-1);
 
-    Xo_sparseMatrixC->nzmax = 0;
-    Xo_sparseMatrixC->m = Xi_sparseMatrixA->m;
-    Xo_sparseMatrixC->n = Xi_sparseMatrixB->n;
-    Xo_sparseMatrixC->p = new int[Xo_sparseMatrixC->m+1];
-    Xo_sparseMatrixC->i = new int[Xo_sparseMatrixC->m * Xo_sparseMatrixC->n];
-    Xo_sparseMatrixC->x = new double[Xo_sparseMatrixC->m * Xo_sparseMatrixC->n];
-    Xo_sparseMatrixC->nz = int(-1);
-    memset(Xo_sparseMatrixC->p, int(-1), sizeof(int) * (Xo_sparseMatrixC->m + 1));
-    memset(Xo_sparseMatrixC->i, int(-1), sizeof(int) * Xo_sparseMatrixC->m * Xo_sparseMatrixC->n);
-    memset(Xo_sparseMatrixC->x, double(0), sizeof(double) * Xo_sparseMatrixC->m * Xo_sparseMatrixC->n);
-    // print_sparse_matrix(Xo_sparseMatrixC, 1);
-
     int *Ap = Xi_sparseMatrixA->p;
     int *Ai = Xi_sparseMatrixA->i;
     double *Ax = Xi_sparseMatrixA->x;
@@ -441,34 +345,199 @@ void multiplySparseMatrix(cs *Xi_sparseMatrixA, cs *Xi_sparseMatrixB, cs *Xo_spa
     int *Bi = Xi_sparseMatrixB->i;
     double *Bx = Xi_sparseMatrixB->x;
 
-    int *Cnzmax = &(Xo_sparseMatrixC->nzmax);
-    int Cm = Xo_sparseMatrixC->m;
-    int Cn = Xo_sparseMatrixC->n;
-    int *Cp = Xo_sparseMatrixC->p;
+    int Cm = Xi_sparseMatrixA->m;
+    int Cn = Xi_sparseMatrixB->n;
+    int *Cp = new int[Cm+1];
+    int *marker = new int[Cn];
+    for(int x=0; x<Cn; x++) marker[x] = -1;
+
+    /* Symbolic pass: the number of distinct columns of every row of C */
+    long nnz = 0;
+    *(Cp) = 0;
+    for(int i=0; i<Cm; i++) {
+        for (int j=*(Ap+i); j<*(Ap+i+1); j++) {
+            for(int k=*(Bp+*(Ai+j)); k<*(Bp+*(Ai+j)+1); k++) {
+                if(marker[*(Bi+k)] != i) {
+                    marker[*(Bi+k)] = i;
+                    nnz++;
+                }
+            }
+        }
+        if(nnz > INT_MAX) exit (-1);
+        *(Cp+i+1) = (int)nnz;
+    }
+
+    Xo_sparseMatrixC->nzmax = (int)nnz;
+    Xo_sparseMatrixC->m = Cm;
+    Xo_sparseMatrixC->n = Cn;
+    Xo_sparseMatrixC->p = Cp;
+    Xo_sparseMatrixC->i = new int[nnz > 0 ? nnz : 1];
+    Xo_sparseMatrixC->x = new double[nnz > 0 ? nnz : 1];
+    Xo_sparseMatrixC->nz = int(-1);
     int *Ci = Xo_sparseMatrixC->i;
     double *Cx = Xo_sparseMatrixC->x;
-    double temp_Cx[Cn]; 
 
-    *(Cp) = *Cnzmax;
+    /* Numeric pass: the columns of row i are appended to Ci as they are first touched */
+    double *spa = new double[Cn > 0 ? Cn : 1];
+    for(int x=0; x<Cn; x++) marker[x] = -1;
     for(int i=0; i<Cm; i++) {
-        memset(temp_Cx, 0, sizeof(double)* Cn);
+        int *row = Ci + *(Cp+i);
+        int len = 0;
         for (int j=*(Ap+i); j<*(Ap+i+1); j++) {
             for(int k=*(Bp+*(Ai+j)); k<*(Bp+*(Ai+j)+1); k++) {
-                temp_Cx[*(Bi+k)] += *(Ax+j) * *(Bx+k);
+                int col = *(Bi+k);
+                if(marker[col] != i) {
+                    marker[col] = i;
+                    spa[col] = 0;
+                    row[len++] = col;
+                }
+                spa[col] += *(Ax+j) * *(Bx+k);
             }
         }
-        for(int x=0; x<Cn; x++) {
-            if(temp_Cx[x] != 0) {
-                *(Ci+(*Cnzmax)) = x;
-                *(Cx+(*Cnzmax)) = temp_Cx[x];
-                (*Cnzmax)++;
+        std::sort(row, row + len);
+        for(int x=0; x<len; x++)
+            *(Cx + *(Cp+i) + x) = spa[row[x]];
+    }
+    // print_sparse_matrix(Xo_sparseMatrixC, 0);
+
+    delete [] spa;
+    delete [] marker;
+}
+
+/* Largest absolute difference between the results of multiplyMatrix and multiplyDenseMatrix */
+double diffDenseMatrix(double **Xi_matrix, dm *Xi_denseMatrix) {
+    double diff = 0;
+    for(int i=0; i<Xi_denseMatrix->m; i++) {
+        for(int j=0; j<Xi_denseMatrix->n; j++) {
+            double d = Xi_matrix[i][j] - Xi_denseMatrix->x[(size_t)i * Xi_denseMatrix->ld + j];
+            if(d < 0) d = -d;
+            if(d > diff) diff = d;
+        }
+    }
+    return diff;
+}
+
+/* The widest GEMM kernel of the CPU */
+const char *gemm_isa() {
+    if(__builtin_cpu_supports("avx512f")) return "avx512";
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return "avx2";
+    return "generic";
+}
+
+/* C = A * B on contiguous row-major matrices, cache-tiled and register-blocked, */
+/* with the widest FMA kernel of the CPU chosen at run time. */
+/* Unlike multiplyMatrix, C is allocated by the caller (dense_init) and reused. */
+void multiplyDenseMatrix(dm *Xi_denseMatrixA, dm *Xi_denseMatrixB, dm *Xo_denseMatrixC) {
+    if(Xi_denseMatrixA->n != Xi_denseMatrixB->m) exit (-1);
+    if(Xo_denseMatrixC->m != Xi_denseMatrixA->m || Xo_denseMatrixC->n != Xi_denseMatrixB->n) exit (-1);
+    memset(Xo_denseMatrixC->x, 0, sizeof(double) * (size_t)Xo_denseMatrixC->m * Xo_denseMatrixC->ld);
+
+    static const char *isa = gemm_isa();
+    if(strcmp(isa, "avx512") == 0)
+        multiplyDenseMatrix_avx512(Xi_denseMatrixA, Xi_denseMatrixB, Xo_denseMatrixC);
+    else if(strcmp(isa, "avx2") == 0)
+        multiplyDenseMatrix_avx2(Xi_denseMatrixA, Xi_denseMatrixB, Xo_denseMatrixC);
+    else
+        multiplyDenseMatrix_generic(Xi_denseMatrixA, Xi_denseMatrixB, Xo_denseMatrixC);
+}
+
+/* C[MR x 16] += A[MR x kc] * B[kc x 16]: 2*MR accumulators, one broadcast of A per row and step */
+template<int MR>
+__attribute__((target("avx512f"), always_inline)) inline
+void gemm_tile_avx512(int kc, const double *A, int lda, const double *B, int ldb, double *C, int ldc) {
+    __m512d c0[MR], c1[MR];
+    for(int r=0; r<MR; r++) {
+        c0[r] = _mm512_load_pd(C + r * ldc);
+        c1[r] = _mm512_load_pd(C + r * ldc + 8);
+    }
+    for(int p=0; p<kc; p++) {
+        __m512d b0 = _mm512_load_pd(B + (size_t)p * ldb);
+        __m512d b1 = _mm512_load_pd(B + (size_t)p * ldb + 8);
+        for(int r=0; r<MR; r++) {
+            __m512d a = _mm512_set1_pd(A[r * lda + p]);
+            c0[r] = _mm512_fmadd_pd(a, b0, c0[r]);
+            c1[r] = _mm512_fmadd_pd(a, b1, c1[r]);
+        }
+    }
+    for(int r=0; r<MR; r++) {
+        _mm512_store_pd(C + r * ldc, c0[r]);
+        _mm512_store_pd(C + r * ldc + 8, c1[r]);
+    }
+}
+
+/* C[MR x 8] += A[MR x kc] * B[kc x 8] */
+template<int MR>
+__attribute__((target("avx2,fma"), always_inline)) inline
+void gemm_tile_avx2(int kc, const double *A, int lda, const double *B, int ldb, double *C, int ldc) {
+    __m256d c0[MR], c1[MR];
+    for(int r=0; r<MR; r++) {
+        c0[r] = _mm256_load_pd(C + r * ldc);
+        c1[r] = _mm256_load_pd(C + r * ldc + 4);
+    }
+    for(int p=0; p<kc; p++) {
+        __m256d b0 = _mm256_load_pd(B + (size_t)p * ldb);
+        __m256d b1 = _mm256_load_pd(B + (size_t)p * ldb + 4);
+        for(int r=0; r<MR; r++) {
+            __m256d a = _mm256_broadcast_sd(A + r * lda + p);
+            c0[r] = _mm256_fmadd_pd(a, b0, c0[r]);
+            c1[r] = _mm256_fmadd_pd(a, b1, c1[r]);
+        }
+    }
+    for(int r=0; r<MR; r++) {
+        _mm256_store_pd(C + r * ldc, c0[r]);
+        _mm256_store_pd(C + r * ldc + 4, c1[r]);
+    }
+}
+
+/* The loops over the tiles: the columns of C are computed up to the padding (ld), */
+/* where B is 0, so only the rows need a remainder tile. */
+#define GEMM_BLOCKED_LOOPS(NR, TILE) \
+    int M = A->m, N = B->n, K = A->n, lda = A->ld, ldb = B->ld, ldc = C->ld; \
+    for(int jc=0; jc<N; jc+=GEMM_NC) { \
+        int jend = jc + GEMM_NC < N ? jc + GEMM_NC : N; \
+        for(int pc=0; pc<K; pc+=GEMM_KC) { \
+            int kc = K - pc < GEMM_KC ? K - pc : GEMM_KC; \
+            for(int ic=0; ic<M; ic+=GEMM_MC) { \
+                int iend = ic + GEMM_MC < M ? ic + GEMM_MC : M; \
+                for(int j=jc; j<jend; j+=NR) { \
+                    const double *b = B->x + (size_t)pc * ldb + j; \
+                    int i = ic; \
+                    for( ; i+4<=iend; i+=4) \
+                        TILE<4>(kc, A->x + (size_t)i * lda + pc, lda, b, ldb, C->x + (size_t)i * ldc + j, ldc); \
+                    for( ; i<iend; i++) \
+                        TILE<1>(kc, A->x + (size_t)i * lda + pc, lda, b, ldb, C->x + (size_t)i * ldc + j, ldc); \
+                } \
+            } \
+        } \
+    }
+
+__attribute__((noinline, target("avx512f"))) void multiplyDenseMatrix_avx512(dm *A, dm *B, dm *C) {
+    GEMM_BLOCKED_LOOPS(16, gemm_tile_avx512)
+}
+
+__attribute__((noinline, target("avx2,fma"))) void multiplyDenseMatrix_avx2(dm *A, dm *B, dm *C) {
+    GEMM_BLOCKED_LOOPS(8, gemm_tile_avx2)
+}
+
+/* The same tiles without intrinsics: the innermost loop runs along a row of B and C */
+/* and is left to the auto-vectorizer */
+__attribute__((noinline)) void multiplyDenseMatrix_generic(dm *A, dm *B, dm *C) {
+    int M = A->m, N = B->n, K = A->n, lda = A->ld, ldb = B->ld, ldc = C->ld;
+    for(int jc=0; jc<N; jc+=GEMM_NC) {
+        int jend = jc + GEMM_NC < N ? jc + GEMM_NC : N;
+        for(int pc=0; pc<K; pc+=GEMM_KC) {
+            int pend = pc + GEMM_KC < K ? pc + GEMM_KC : K;
+            for(int i=0; i<M; i++) {
+                double *__restrict c = C->x + (size_t)i * ldc;
+                for(int p=pc; p<pend; p++) {
+                    double a = A->x[(size_t)i * lda + p];
+                    const double *__restrict b = B->x + (size_t)p * ldb;
+                    for(int j=jc; j<jend; j++)
+                        c[j] += a * b[j];
+                }
             }
-            // cout << temp_Cx[x] << " ";
         }
-        *(Cp+i+1) = *Cnzmax;
-        // cout << endl;
     }
-    // print_sparse_matrix(Xo_sparseMatrixC, 0);
 }
 
 double wtime()
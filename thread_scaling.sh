@@ -0,0 +1,53 @@
+#!/bin/bash
+# Run flop_loop with 1, 2, 4, ... N threads under the tool and print the
+# instrumented throughput. Every iteration enters the target routine
+# flop_kernel, so the routine entry path is exercised by all threads at once.
+# Fails if the parallel efficiency at N threads drops below MIN_EFFICIENCY, or
+# if flop_kernel was not counted, which would only measure Pin itself.
+#
+# Usage: ./thread_scaling.sh <pin> <tool> <flop_loop.exe> [max threads] [iterations per thread]
+
+PIN=${1}
+TOOL=${2}
+APP=${3}
+NCPU=$(nproc)
+MAXTHREADS=${4:-$(( NCPU < 32 ? NCPU : 32 ))}
+ITERS=${5:-2000000}
+MIN_EFFICIENCY=${MIN_EFFICIENCY:-0.5}
+REPORT=$(mktemp)
+trap "rm -f ${REPORT}" EXIT
+
+printf "%-10s %16s %12s\n" "[threads]" "[iterations/s]" "[speedup]"
+base=""
+nthreads=1
+while [ ${nthreads} -le ${MAXTHREADS} ]; do
+    tp=$(${PIN} -t ${TOOL} -rtn flop_kernel -format csv -o ${REPORT} -- ${APP} ${ITERS} ${nthreads} 2> /dev/null \
+         | awk '/^throughput:/ { print $2 }')
+    if [ -z "${tp}" ]; then
+        echo "run with ${nthreads} threads failed"
+        exit 1
+    fi
+    # The calls of the routine total (the record without tid)
+    calls=$(awk -F, 'NR == 1 { for(i=1; i<=NF; i++) col[$i] = i; next }
+                     $1 == "routine" && $col["tid"] == "" && $col["routine"] == "flop_kernel" { print $col["calls"] }' ${REPORT})
+    if [ -z "${calls}" ] || [ "${calls}" -eq 0 ]; then
+        echo "flop_kernel was not counted with ${nthreads} threads"
+        exit 1
+    fi
+    base=${base:-${tp}}
+    speedup=$(awk "BEGIN { print ${tp} / ${base} }")
+    printf "%-10s %16.0f %12.2f\n" ${nthreads} ${tp} ${speedup}
+    last=${nthreads}
+    lastspeedup=${speedup}
+    if [ ${nthreads} -lt ${MAXTHREADS} ] && [ $(( nthreads * 2 )) -gt ${MAXTHREADS} ]; then
+        nthreads=${MAXTHREADS}
+    else
+        nthreads=$(( nthreads * 2 ))
+    fi
+done
+
+awk "BEGIN { exit !(${lastspeedup} / ${last} >= ${MIN_EFFICIENCY}) }"
+if [ ${?} -ne 0 ]; then
+    echo "parallel efficiency at ${last} threads is below ${MIN_EFFICIENCY}"
+    exit 1
+fi